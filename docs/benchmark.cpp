@@ -0,0 +1,180 @@
+#include <htmlanim.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+
+static size_t num_allocations = 0;
+
+// Inlined replacements make GCC pair malloc() and free() with new and delete and report a mismatch
+#if defined(__GNUC__)
+#define REPLACEMENT_NOINLINE __attribute__((noinline))
+#else
+#define REPLACEMENT_NOINLINE
+#endif
+
+REPLACEMENT_NOINLINE void* operator new(std::size_t size) {
+	++num_allocations;
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+REPLACEMENT_NOINLINE void* operator new[](std::size_t size) {
+	++num_allocations;
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+REPLACEMENT_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+REPLACEMENT_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+REPLACEMENT_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+REPLACEMENT_NOINLINE void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+constexpr size_t n_shapes = 20000;
+constexpr size_t drawables_per_shape = 5;
+
+void build_scene(HtmlAnim::Frame& frame) {
+	for (size_t i = 0; i < n_shapes; ++i) {
+		const auto x = static_cast<double>(i % 600);
+		const auto y = static_cast<double>(i % 500);
+		frame.fill_style("red")
+			.arc(x, y, 5, true)
+			.rect(x, y, 10, 10)
+			.line(x, y, x + 10, y + 10)
+			.line_width(2);
+	}
+}
+
+template<typename F>
+void measure(const char* name, F&& f) {
+	const auto allocations_before = num_allocations;
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	f();
+	const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+	const auto allocations = num_allocations - allocations_before;
+	std::cout << std::setw(24) << std::left << name
+		<< std::fixed << std::setprecision(2)
+		<< static_cast<double>(allocations) / (n_shapes * drawables_per_shape) << " allocations/drawable, "
+		<< std::setprecision(1) << elapsed.count() * 1000 << " ms\n";
+}
+
+void build_animation(HtmlAnim::HtmlAnim& anim) {
+	for (size_t frame = 0; frame < 20000; ++frame) {
+		for (size_t i = 0; i < 10; ++i) {
+			anim.frame().arc(frame % 600, i * 50, 5 + i, i % 2 == 0).line(0, 0, frame % 600, i * 50);
+		}
+		anim.next_frame();
+	}
+}
+
+std::string write_with_threads(const HtmlAnim::HtmlAnim& anim, size_t n_threads) {
+	std::ostringstream ss;
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	anim.write_stream(ss);
+	const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+	std::cout << "write with " << std::setw(2) << n_threads << " threads  "
+		<< std::fixed << std::setprecision(1) << elapsed.count() * 1000 << " ms\n";
+	return ss.str();
+}
+
+constexpr size_t n_lines = 1000000;
+
+template<typename F>
+void measure_output(const char* name, F&& f) {
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	const auto bytes = f();
+	const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+	std::cout << std::setw(24) << std::left << name
+		<< std::fixed << std::setprecision(1) << bytes / elapsed.count() / (1024 * 1024) << " MB/s\n";
+}
+
+void benchmark_output() {
+	const char* path = "benchmark_output.tmp";
+	measure_output("std::ofstream <<", [path] {
+		std::ofstream os(path);
+		for (size_t i = 0; i < n_lines; ++i) {
+			os << "line(ctx, " << static_cast<int>(i % 600) << ", " << static_cast<int>(i % 500)
+				<< ", " << static_cast<int>(i % 300) << ", " << static_cast<int>(i % 200) << ");\n";
+			os << "arc(ctx, " << std::to_string(static_cast<double>(i % 600)) << ", "
+				<< std::to_string(i * 0.25) << ", " << std::to_string(5.0) << ", "
+				<< std::to_string(0.0) << ", " << std::to_string(2 * HtmlAnim::PI) << ", true);\n";
+		}
+		return static_cast<size_t>(os.tellp());
+	});
+	measure_output("OutputSink <<", [path] {
+		auto fp = std::fopen(path, "w");
+		size_t bytes = 0;
+		{
+			HtmlAnim::OutputSink out(fp);
+			for (size_t i = 0; i < n_lines; ++i) {
+				out << "line(ctx, " << static_cast<int>(i % 600) << ", " << static_cast<int>(i % 500)
+					<< ", " << static_cast<int>(i % 300) << ", " << static_cast<int>(i % 200) << ");\n";
+				out << "arc(ctx, " << static_cast<double>(i % 600) << ", "
+					<< i * 0.25 << ", " << 5.0 << ", "
+					<< 0.0 << ", " << 2 * HtmlAnim::PI << ", true);\n";
+			}
+			bytes = static_cast<size_t>(std::ftell(fp)) + out.size();
+		}
+		std::fclose(fp);
+		return bytes;
+	});
+	std::remove(path);
+}
+
+constexpr size_t n_samples = 1000000;
+
+void benchmark_polyline() {
+	HtmlAnim::Vec2Vector samples;
+	samples.reserve(n_samples);
+	for (size_t i = 0; i < n_samples; ++i) {
+		samples.emplace_back(i * 1000.0 / n_samples, 250 + 200 * std::sin(i * 0.0001) + (i * 7919 % 13));
+	}
+	auto write = [&samples](const char* name, bool polyline, bool decimate) {
+		HtmlAnim::HtmlAnim anim("Polyline", 1000, 500);
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		if (polyline)
+			anim.frame().polyline(samples, false, false, decimate);
+		else
+			anim.frame().line(samples);
+		std::ostringstream ss;
+		anim.write_stream(ss);
+		const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+		std::cout << std::setw(24) << std::left << name
+			<< std::fixed << std::setprecision(1) << ss.str().size() / 1024.0 << " KB, "
+			<< elapsed.count() * 1000 << " ms\n";
+	};
+	write("line 1M points", false, false);
+	write("polyline 1M points", true, false);
+	write("polyline decimated", true, true);
+}
+
+int main() {
+	measure("heap (Frame)", [] {
+		HtmlAnim::Frame frame;
+		build_scene(frame);
+	});
+	measure("arena (Layer)", [] {
+		HtmlAnim::Layer layer;
+		build_scene(layer.frame());
+	});
+
+	benchmark_output();
+	benchmark_polyline();
+
+	HtmlAnim::HtmlAnim anim("Benchmark", 600, 500);
+	build_animation(anim);
+	const auto serial = write_with_threads(anim, 1);
+	const auto n_threads = std::max(2u, std::thread::hardware_concurrency());
+	anim.set_num_writer_threads(n_threads);
+	const auto parallel = write_with_threads(anim, n_threads);
+	std::cout << "parallel output " << (serial == parallel ? "identical" : "DIFFERENT") << "\n";
+}
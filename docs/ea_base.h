@@ -1,10 +1,20 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <utility>
 #include <random>
 #include <algorithm>
 #include <iomanip>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
 #include <stdexcept>
 
 namespace EA {
@@ -13,15 +23,56 @@ using FitnessType = std::vector<double>;
 using GeneType = double;
 using GeneVector = std::vector<GeneType>;
 
+/// SplitMix64, cheap enough to start a new stream for every solution in every generation
+class Rng {
+	std::uint64_t state;
+
+	static std::uint64_t mix(std::uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+public:
+	using result_type = std::uint64_t;
+
+	explicit Rng(std::uint64_t seed) : state{ seed } {}
+
+	/// Stream of one solution in one generation, the same whichever thread draws from it
+	static Rng stream(std::uint64_t master_seed, std::uint64_t generation, std::uint64_t index) {
+		return Rng(mix(master_seed + mix(generation + 0x9E3779B97F4A7C15ull) + mix(~index)));
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT64_MAX; }
+
+	result_type operator()() {
+		return mix(state += 0x9E3779B97F4A7C15ull);
+	}
+};
+
+template<typename It>
+void randomize_genes(It begin, It end, GeneType lb, GeneType ub, Rng& rng) {
+	std::uniform_real_distribution<GeneType> distribution(lb, ub);
+	for (auto it = begin; it != end; ++it) {
+		*it = distribution(rng);
+	}
+}
+
+template<typename It>
+void mutate_genes(It begin, It end, GeneType mean, GeneType stddev, Rng& rng) {
+	std::normal_distribution<GeneType> distribution(mean, stddev);
+	for (auto it = begin; it != end; ++it) {
+		const auto r = distribution(rng);
+		*it += r;
+	}
+}
+
 class SolutionBase {
 protected:
 	FitnessType fitness;
 	GeneVector gene_vec;
 
-	auto get_random_seed() {
-		return static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count());
-	}
-
 public:
 	explicit SolutionBase(size_t fitness_size, size_t s)
 		: fitness(fitness_size, 0), gene_vec(s, 0) {
@@ -36,98 +87,455 @@ public:
 
 	virtual const FitnessType& get_fitness() const { return fitness; }
 
-	virtual void randomize(GeneType lb, GeneType ub) {
-		std::default_random_engine generator(get_random_seed());
-		std::uniform_real_distribution<GeneType> distribution(lb, ub);
-		for (auto& g : gene_vec) {
-			g = distribution(generator);
+	/// Called once by Population with the solution's own stream, e.g. to randomize the genes
+	virtual void initialize(Rng&) {}
+
+	virtual void randomize(GeneType lb, GeneType ub, Rng& rng) {
+		randomize_genes(gene_vec.begin(), gene_vec.end(), lb, ub, rng);
+	}
+
+	virtual void mutate(GeneType mean, GeneType stddev, Rng& rng) {
+		mutate_genes(gene_vec.begin(), gene_vec.end(), mean, stddev, rng);
+	}
+
+	virtual void evaluate() = 0;
+};
+
+/// Threads that live as long as the pool and run one job per generation.
+/// The calling thread runs part 0 itself and returns when all parts are done,
+/// rethrowing the first exception any part threw
+class WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_cond;
+	std::condition_variable done_cond;
+	std::function<void(size_t)> job;
+	size_t generation = 0;
+	size_t num_running = 0;
+	bool stop = false;
+	std::exception_ptr error;
+
+	void run_part(const std::function<void(size_t)>& f, size_t part) {
+		try {
+			f(part);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
 		}
 	}
 
-	virtual void mutate(GeneType mean, GeneType stddev) {
-		std::default_random_engine generator(get_random_seed());
-		std::normal_distribution<GeneType> distribution(mean, stddev);
-		for (auto& g : gene_vec) {
-			const auto r = distribution(generator);
-			g += r;
+	void work(size_t part) {
+		size_t seen_generation = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cond.wait(lock, [&] { return stop || generation != seen_generation; });
+				if (stop)
+					return;
+				seen_generation = generation;
+			}
+			run_part(job, part);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--num_running == 0)
+					done_cond.notify_one();
+			}
 		}
 	}
 
-	virtual void evaluate() = 0;
+public:
+	/// With n_parts 0 there is one part per hardware thread
+	explicit WorkerPool(size_t n_parts) {
+		if (n_parts == 0)
+			n_parts = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t i = 1; i < n_parts; ++i) {
+			threads.emplace_back(&WorkerPool::work, this, i);
+		}
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		start_cond.notify_all();
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+
+	size_t size() const { return threads.size() + 1; }
+
+	/// Calls f(part) for every part in 0..size()-1 in parallel
+	void run(const std::function<void(size_t)>& f) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = f;
+			num_running = threads.size();
+			++generation;
+		}
+		start_cond.notify_all();
+		run_part(f, 0);
+		std::exception_ptr part_error;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			done_cond.wait(lock, [&] { return num_running == 0; });
+			std::swap(part_error, error);
+		}
+		if (part_error)
+			std::rethrow_exception(part_error);
+	}
+
+	/// Calls f(begin, end) for chunks covering 0..n in parallel. Threads take chunks until none are left,
+	/// so uneven costs balance out. After an exception the remaining chunks are dropped
+	void for_each_chunk(size_t n, const std::function<void(size_t, size_t)>& f) {
+		const auto chunk_size = std::max<size_t>(1, n / (size() * 16));
+		std::atomic<size_t> next_i{ 0 };
+		run([n, chunk_size, &next_i, &f](size_t) {
+			try {
+				for (auto begin_i = next_i.fetch_add(chunk_size); begin_i < n; begin_i = next_i.fetch_add(chunk_size)) {
+					f(begin_i, std::min(n, begin_i + chunk_size));
+				}
+			}
+			catch (...) {
+				next_i = n;
+				throw;
+			}
+		});
+	}
+};
+
+/// Picks the survivors of a generation from cached fitness keys, compared lexicographically.
+/// Nothing is sorted or moved: each copy (to, from) overwrites a solution that did not survive
+/// with a survivor. Survivors are never overwritten, so the copies can run in place in any order
+class Selection {
+public:
+	enum class Method {
+		/// The better half survives, found with nth_element
+		Truncation,
+		/// Winners of tournaments between random solutions survive, the best always does
+		Tournament
+	};
+
+private:
+	Method method;
+	size_t tournament_size;
+	std::vector<size_t> order;
+	std::vector<char> survives;
+	std::vector<std::pair<size_t, size_t>> copies;
+	size_t best = 0;
+
+	void select_truncation(const double* keys, size_t key_size, size_t n) {
+		const auto less = [keys, key_size](size_t i1, size_t i2) {
+			return std::lexicographical_compare(keys + i1 * key_size, keys + (i1 + 1) * key_size,
+				keys + i2 * key_size, keys + (i2 + 1) * key_size);
+		};
+		const auto n_survivors = (n + 1) / 2;
+		order.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			order[i] = i;
+		}
+		std::nth_element(order.begin(), order.begin() + (n_survivors - 1), order.end(), less);
+		best = *std::min_element(order.begin(), order.begin() + n_survivors, less);
+		for (auto i = n_survivors; i < n; ++i) {
+			copies.emplace_back(order[i], order[i - n_survivors]);
+		}
+	}
+
+	void select_tournament(const double* keys, size_t key_size, size_t n, Rng& rng) {
+		const auto less = [keys, key_size](size_t i1, size_t i2) {
+			return std::lexicographical_compare(keys + i1 * key_size, keys + (i1 + 1) * key_size,
+				keys + i2 * key_size, keys + (i2 + 1) * key_size);
+		};
+		best = 0;
+		for (size_t i = 1; i < n; ++i) {
+			if (less(i, best))
+				best = i;
+		}
+		order.assign(1, best);
+		std::uniform_int_distribution<size_t> distribution(0, n - 1);
+		const auto n_winners = (n + 1) / 2;
+		while (order.size() < n_winners) {
+			auto winner = distribution(rng);
+			for (size_t i = 1; i < tournament_size; ++i) {
+				const auto challenger = distribution(rng);
+				if (less(challenger, winner))
+					winner = challenger;
+			}
+			order.push_back(winner);
+		}
+		survives.assign(n, 0);
+		for (const auto i : order) {
+			survives[i] = 1;
+		}
+		size_t next_winner = 0;
+		for (size_t i = 0; i < n; ++i) {
+			if (!survives[i]) {
+				copies.emplace_back(i, order[next_winner]);
+				next_winner = (next_winner + 1) % n_winners;
+			}
+		}
+	}
+
+public:
+	explicit Selection(Method method = Method::Truncation, size_t tournament_size = 2)
+		: method{ method }, tournament_size{ tournament_size } {
+		if (tournament_size == 0)
+			throw std::logic_error("Tournament size must be at least 1");
+	}
+
+	/// keys holds key_size values for each of the n solutions
+	void select(const double* keys, size_t key_size, size_t n, Rng& rng) {
+		copies.clear();
+		if (n == 0)
+			return;
+		if (method == Method::Truncation)
+			select_truncation(keys, key_size, n);
+		else
+			select_tournament(keys, key_size, n, rng);
+	}
+
+	size_t get_best() const {
+		return best;
+	}
+
+	const std::vector<std::pair<size_t, size_t>>& get_copies() const {
+		return copies;
+	}
 };
 
-template<class T, size_t n_threads>
+template<class T>
 class Population {
 	using SolutionVector = std::vector<std::unique_ptr<SolutionBase>>;
 	SolutionVector sol_vec;
+	WorkerPool pool;
+	std::uint64_t master_seed;
+	std::uint64_t generation = 0;
+	size_t key_size = 0;
+	/// Fitness of every solution, copied while evaluating so selection does not chase pointers
+	std::vector<double> keys;
+	Selection selection;
 
-	void sort_by_fitness() {
-		std::sort(sol_vec.begin(), sol_vec.end(),
-			[](const auto& sol1, const auto& sol2) {
-				return sol1->get_fitness() < sol2->get_fitness(); 
-			});
+	void select() {
+		auto rng = Rng::stream(master_seed, generation, sol_vec.size());
+		selection.select(keys.data(), key_size, sol_vec.size(), rng);
 	}
 
 	void mutate_and_evaluate(GeneType mutation_stddev) {
-		std::vector<std::thread> threads;
-		if (sol_vec.size() % n_threads != 0) {
-			throw std::invalid_argument("Population size must be multiple of n_threads");
-		}
-
-		auto evaluate_thread = [this, mutation_stddev](size_t start_i, size_t end_i) {
-			for (size_t i = start_i; i < end_i; ++i) {
+		pool.for_each_chunk(sol_vec.size(), [this, mutation_stddev](size_t begin_i, size_t end_i) {
+			for (auto i = begin_i; i < end_i; ++i) {
 				auto& sol = sol_vec[i];
-				sol->mutate(0, mutation_stddev);
+				auto rng = Rng::stream(master_seed, generation, i);
+				sol->mutate(0, mutation_stddev, rng);
 				sol->evaluate();
+				const auto& fitness = sol->get_fitness();
+				std::copy(fitness.begin(), fitness.end(), keys.begin() + i * key_size);
 			}
-		};
-
-		const auto batch_size = sol_vec.size() / n_threads;
-		for (size_t i = 0; i < n_threads; ++i) {
-			threads.push_back(std::thread(evaluate_thread, i * batch_size, (i + 1) * batch_size));
-		}
-
-		for (auto& t : threads) {
-			if (t.joinable())
-				t.join();
-		}
+		});
+		++generation;
 	}
 
+	/// Survivors of the last selection replace the other solutions
 	void procreate() {
-		for (size_t i = 0; i < sol_vec.size() / 2; ++i) {
-			*sol_vec[sol_vec.size() / 2 + i] = *sol_vec[i];
-		}
+		const auto& copies = selection.get_copies();
+		pool.for_each_chunk(copies.size(), [this, &copies](size_t begin_i, size_t end_i) {
+			for (auto i = begin_i; i < end_i; ++i) {
+				*sol_vec[copies[i].first] = *sol_vec[copies[i].second];
+			}
+		});
 	}
 
 public:
-	Population(size_t s) {
+	/// n_threads defaults to the number of hardware threads.
+	/// Runs with the same master_seed give the same solutions for any number of threads
+	explicit Population(size_t s, size_t n_threads = 0, std::uint64_t master_seed = 0)
+		: pool{ n_threads }, master_seed{ master_seed } {
 		sol_vec.resize(s);
 		for (size_t i = 0; i < s; ++i) {
 			sol_vec[i] = std::make_unique<T>();
+			auto rng = Rng::stream(master_seed, generation, i);
+			sol_vec[i]->initialize(rng);
 		}
+		++generation;
+		if (s > 0)
+			key_size = sol_vec.front()->get_fitness().size();
+		keys.resize(s * key_size);
 
 		mutate_and_evaluate(10E-99);
-		sort_by_fitness();
+		select();
+	}
+
+	/// Used from the next evolve() on
+	void set_selection(const Selection& sel) {
+		selection = sel;
 	}
 
 	const auto size() const {
 		return sol_vec.size();
 	}
 
+	size_t get_num_threads() const {
+		return pool.size();
+	}
+
+	/// Solutions are not kept in order of fitness
 	const auto get(size_t i) const {
 		return dynamic_cast<T*>(sol_vec[i].get());
 	}
 
 	const auto& get_best() const {
-		return sol_vec.front();
+		return sol_vec[selection.get_best()];
 	}
 
 	void evolve(GeneType stddev) {
 		procreate();
 		mutate_and_evaluate(stddev);
-		sort_by_fitness();
+		select();
+	}
+
+};
+
+/// Genes and fitness of one solution, stored in the matrices of a ContiguousPopulation
+class SolutionView {
+	GeneType* genes;
+	size_t n_genes;
+	double* fitness;
+	size_t fitness_size;
+
+public:
+	SolutionView(GeneType* genes, size_t n_genes, double* fitness, size_t fitness_size)
+		: genes{ genes }, n_genes{ n_genes }, fitness{ fitness }, fitness_size{ fitness_size } {}
+
+	size_t size() const { return n_genes; }
+	GeneType& operator[](size_t i) { return genes[i]; }
+	const GeneType& operator[](size_t i) const { return genes[i]; }
+	GeneType* begin() { return genes; }
+	GeneType* end() { return genes + n_genes; }
+	const GeneType* begin() const { return genes; }
+	const GeneType* end() const { return genes + n_genes; }
+
+	double& fitness_at(size_t i) { return fitness[i]; }
+	FitnessType get_fitness() const { return FitnessType(fitness, fitness + fitness_size); }
+
+	void randomize(GeneType lb, GeneType ub, Rng& rng) { randomize_genes(begin(), end(), lb, ub, rng); }
+	void mutate(GeneType mean, GeneType stddev, Rng& rng) { mutate_genes(begin(), end(), mean, stddev, rng); }
+};
+
+/// Rows of genes in one block, each row starting on a 64 byte boundary
+class GeneMatrix {
+	size_t stride;
+	std::vector<GeneType> storage;
+	GeneType* data;
+
+public:
+	GeneMatrix(size_t rows, size_t cols)
+		: stride{ (cols + 64 / sizeof(GeneType) - 1) / (64 / sizeof(GeneType)) * (64 / sizeof(GeneType)) },
+		storage(rows * stride + 64 / sizeof(GeneType)) {
+		void* p = storage.data();
+		auto space = storage.size() * sizeof(GeneType);
+		data = static_cast<GeneType*>(std::align(64, rows * stride * sizeof(GeneType), p, space));
+	}
+
+	GeneMatrix(const GeneMatrix&) = delete;
+	GeneMatrix& operator=(const GeneMatrix&) = delete;
+
+	GeneType* row(size_t i) { return data + i * stride; }
+};
+
+/// Population of plain gene vectors kept in one gene matrix and one fitness matrix.
+/// T provides num_genes(), fitness_size(), initialize(SolutionView&, Rng&) and evaluate(SolutionView&).
+/// With the same T, size, seed and selection the results equal those of Population
+template<class T>
+class ContiguousPopulation {
+	T problem;
+	size_t n_solutions;
+	size_t n_genes;
+	size_t fitness_size;
+	GeneMatrix genes;
+	std::vector<double> fitness;
+	WorkerPool pool;
+	std::uint64_t master_seed;
+	std::uint64_t generation = 0;
+	Selection selection;
+
+	SolutionView row_view(size_t i) {
+		return SolutionView(genes.row(i), n_genes, fitness.data() + i * fitness_size, fitness_size);
+	}
+
+	void select() {
+		auto rng = Rng::stream(master_seed, generation, n_solutions);
+		selection.select(fitness.data(), fitness_size, n_solutions, rng);
+	}
+
+	void mutate_and_evaluate(GeneType mutation_stddev) {
+		pool.for_each_chunk(n_solutions, [this, mutation_stddev](size_t begin_i, size_t end_i) {
+			for (auto i = begin_i; i < end_i; ++i) {
+				auto sol = row_view(i);
+				auto rng = Rng::stream(master_seed, generation, i);
+				sol.mutate(0, mutation_stddev, rng);
+				problem.evaluate(sol);
+			}
+		});
+		++generation;
+	}
+
+	void procreate() {
+		const auto& copies = selection.get_copies();
+		pool.for_each_chunk(copies.size(), [this, &copies](size_t begin_i, size_t end_i) {
+			for (auto i = begin_i; i < end_i; ++i) {
+				std::memcpy(genes.row(copies[i].first), genes.row(copies[i].second), n_genes * sizeof(GeneType));
+			}
+		});
 	}
 
+public:
+	explicit ContiguousPopulation(size_t s, size_t n_threads = 0, std::uint64_t master_seed = 0, const T& problem = T())
+		: problem{ problem }, n_solutions{ s }, n_genes{ problem.num_genes() }, fitness_size{ problem.fitness_size() },
+		genes{ s, n_genes }, fitness(s * fitness_size, 0), pool{ n_threads }, master_seed{ master_seed } {
+		for (size_t i = 0; i < s; ++i) {
+			auto sol = row_view(i);
+			std::fill(sol.begin(), sol.end(), 0);
+			auto rng = Rng::stream(master_seed, generation, i);
+			this->problem.initialize(sol, rng);
+		}
+		++generation;
+
+		mutate_and_evaluate(10E-99);
+		select();
+	}
+
+	/// Used from the next evolve() on
+	void set_selection(const Selection& sel) {
+		selection = sel;
+	}
+
+	size_t size() const {
+		return n_solutions;
+	}
+
+	size_t get_num_threads() const {
+		return pool.size();
+	}
+
+	/// Solutions are not kept in order of fitness, the view is valid until the next evolve()
+	SolutionView get(size_t i) {
+		return row_view(i);
+	}
+
+	SolutionView get_best() {
+		return get(selection.get_best());
+	}
+
+	void evolve(GeneType stddev) {
+		procreate();
+		mutate_and_evaluate(stddev);
+		select();
+	}
 };
 
 } // namespace EA
@@ -0,0 +1,159 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "ea_base.h"
+
+using namespace EA;
+
+constexpr size_t n_threads = 8;
+constexpr size_t n_genes = 16;
+constexpr size_t evaluations_per_run = 2000000;
+
+/// Cheap fitness, so the cost of scheduling the threads shows
+class SphereSolution : public SolutionBase {
+public:
+	SphereSolution() : SolutionBase(1, n_genes) {}
+
+	virtual void initialize(Rng& rng) override {
+		randomize(-10, 10, rng);
+	}
+
+	virtual void evaluate() override {
+		fitness[0] = 0;
+		for (const auto g : gene_vec) {
+			fitness[0] += g * g;
+		}
+	}
+};
+
+/// Same problem for ContiguousPopulation
+class SphereProblem {
+public:
+	size_t num_genes() const { return n_genes; }
+	size_t fitness_size() const { return 1; }
+
+	void initialize(SolutionView& sol, Rng& rng) const {
+		sol.randomize(-10, 10, rng);
+	}
+
+	void evaluate(SolutionView& sol) const {
+		double f = 0;
+		for (const auto g : sol) {
+			f += g * g;
+		}
+		sol.fitness_at(0) = f;
+	}
+};
+
+/// One generation the way Population did it before it kept its threads
+void evolve_spawning_threads(std::vector<std::unique_ptr<SolutionBase>>& sol_vec, GeneType stddev, size_t generation) {
+	for (size_t i = 0; i < sol_vec.size() / 2; ++i) {
+		*sol_vec[sol_vec.size() / 2 + i] = *sol_vec[i];
+	}
+	std::vector<std::thread> threads;
+	const auto batch_size = sol_vec.size() / n_threads;
+	for (size_t t = 0; t < n_threads; ++t) {
+		threads.emplace_back([&sol_vec, stddev, generation, batch_size, t] {
+			for (size_t i = t * batch_size; i < (t + 1) * batch_size; ++i) {
+				auto rng = Rng::stream(0, generation, i);
+				sol_vec[i]->mutate(0, stddev, rng);
+				sol_vec[i]->evaluate();
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	std::sort(sol_vec.begin(), sol_vec.end(),
+		[](const auto& sol1, const auto& sol2) { return sol1->get_fitness() < sol2->get_fitness(); });
+}
+
+template<typename F>
+double gens_per_sec(size_t n_gens, F&& evolve) {
+	const auto start_time = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < n_gens; ++i) {
+		evolve();
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+	return n_gens / elapsed.count();
+}
+
+/// Milliseconds to pick the survivors of one generation: the full sort of solution pointers
+/// Population used before, nth_element and tournaments on cached keys
+void bench_selection(size_t size) {
+	constexpr size_t n_reps = 5;
+
+	std::vector<std::unique_ptr<SolutionBase>> sol_vec;
+	for (size_t i = 0; i < size; ++i) {
+		sol_vec.emplace_back(std::make_unique<SphereSolution>());
+		auto rng = Rng::stream(0, 0, i);
+		sol_vec.back()->initialize(rng);
+		sol_vec.back()->evaluate();
+	}
+	std::vector<double> keys;
+	for (const auto& sol : sol_vec) {
+		keys.push_back(sol->get_fitness()[0]);
+	}
+
+	Rng shuffle_rng(0);
+	std::chrono::duration<double, std::milli> sorting{ 0 };
+	for (size_t i = 0; i < n_reps; ++i) {
+		std::shuffle(sol_vec.begin(), sol_vec.end(), shuffle_rng);
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		std::sort(sol_vec.begin(), sol_vec.end(),
+			[](const auto& sol1, const auto& sol2) { return sol1->get_fitness() < sol2->get_fitness(); });
+		sorting += std::chrono::high_resolution_clock::now() - start_time;
+	}
+
+	const auto ms_per_selection = [&keys, size](Selection selection) {
+		Rng rng(0);
+		const auto start_time = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < n_reps; ++i) {
+			selection.select(keys.data(), 1, size, rng);
+		}
+		const std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+		return elapsed.count() / n_reps;
+	};
+	const auto truncation = ms_per_selection(Selection(Selection::Method::Truncation));
+	const auto tournament = ms_per_selection(Selection(Selection::Method::Tournament, 2));
+
+	std::cout << "selection  " << std::setw(8) << std::left << size
+		<< std::fixed << std::setprecision(2)
+		<< " sort pointers " << std::setw(8) << sorting.count() / n_reps << " ms,"
+		<< " nth_element " << std::setw(8) << truncation << " ms,"
+		<< " tournament " << std::setw(8) << tournament << " ms\n";
+}
+
+int main() {
+	for (const size_t size : { 64, 1000, 16384 }) {
+		const auto n_gens = evaluations_per_run / size;
+
+		std::vector<std::unique_ptr<SolutionBase>> sol_vec;
+		for (size_t i = 0; i < size; ++i) {
+			sol_vec.emplace_back(std::make_unique<SphereSolution>());
+			auto rng = Rng::stream(0, 0, i);
+			sol_vec.back()->initialize(rng);
+		}
+		size_t generation = 1;
+		const auto spawning = gens_per_sec(n_gens, [&] { evolve_spawning_threads(sol_vec, 0.1, generation++); });
+
+		Population<SphereSolution> pop(size, n_threads);
+		const auto pooled = gens_per_sec(n_gens, [&pop] { pop.evolve(0.1); });
+
+		ContiguousPopulation<SphereProblem> contiguous_pop(size, n_threads);
+		const auto contiguous = gens_per_sec(n_gens, [&contiguous_pop] { contiguous_pop.evolve(0.1); });
+
+		std::cout << "population " << std::setw(6) << std::left << size
+			<< std::fixed << std::setprecision(1)
+			<< " spawn threads " << std::setw(9) << spawning << " gens/sec,"
+			<< " worker pool " << std::setw(9) << pooled << " gens/sec,"
+			<< " contiguous " << std::setw(9) << contiguous << " gens/sec\n";
+	}
+
+	for (const size_t size : { 10000, 100000, 1000000 }) {
+		bench_selection(size);
+	}
+}
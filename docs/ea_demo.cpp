@@ -17,8 +17,10 @@ class CirclesSolution : public SolutionBase {
 	auto get_y(size_t i) const { return gene_vec[2 * i + 1]; }
 
 public:
-	CirclesSolution() : SolutionBase(fitness_size, num_circles * 2) {
-		randomize(-300, 300);
+	CirclesSolution() : SolutionBase(fitness_size, num_circles * 2) {}
+
+	virtual void initialize(Rng& rng) override {
+		randomize(-300, 300, rng);
 	}
 
 	void draw(HtmlAnim::HtmlAnim& anim) const {
@@ -65,7 +67,7 @@ int main() {
 	anim.frame().add_drawable(HtmlAnimShapes::subdivided_grid(0, 0, 50, 50, 12, 12, 5, 5));
 	anim.add_layer();
 
-	Population<CirclesSolution, 8> pop(10000);
+	Population<CirclesSolution> pop(10000);
 
 	FitnessType best_fitness;
 	CirclesSolution best_solution;
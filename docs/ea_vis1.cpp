@@ -14,8 +14,10 @@ class CirclesSolution : public SolutionBase {
 public:
 	static constexpr int range = 300;
 
-	CirclesSolution() : SolutionBase(1, 2) {
-		randomize(-range, range);
+	CirclesSolution() : SolutionBase(1, 2) {}
+
+	virtual void initialize(Rng& rng) override {
+		randomize(-range, range, rng);
 	}
 
 	void draw(HtmlAnim::HtmlAnim& anim) const {
@@ -27,6 +29,8 @@ public:
 	}
 };
 
+constexpr size_t CirclesSolution::radius;
+
 int main() {
 	static constexpr auto screen_size = CirclesSolution::range * 2;
 	
@@ -35,7 +39,7 @@ int main() {
 	anim.frame().add_drawable(HtmlAnimShapes::subdivided_grid(0, 0, 50, 50, screen_size/50, screen_size/50, 5, 5));
 	anim.add_layer();
 
-	Population<CirclesSolution, 2> pop(2);
+	Population<CirclesSolution> pop(2, 2);
 
 	FitnessType best_fitness;
 	CirclesSolution best_solution;
@@ -0,0 +1,50 @@
+#include <htmlanim.hpp>
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+/// A frame that cannot be written, far enough in that several writer threads are busy when it throws
+void build_animation(HtmlAnim::HtmlAnim& anim, size_t bad_frame) {
+	for (size_t i = 0; i < 1000; ++i) {
+		if (i == bad_frame) {
+			const auto& r = anim.frame().compute(HtmlAnim::Formula::variable());
+			anim.frame().arc(10, 10, r, true);
+		}
+		else {
+			anim.frame().rect(static_cast<double>(i), 0, 10, 10);
+		}
+		anim.next_frame();
+	}
+}
+
+bool throws_logic_error(size_t num_threads, bool dedupe, size_t bad_frame) {
+	HtmlAnim::HtmlAnim anim("Write errors", 100, 100);
+	anim.set_num_writer_threads(num_threads);
+	anim.set_dedupe_frames(dedupe);
+	build_animation(anim, bad_frame);
+	std::ostringstream ss;
+	try {
+		anim.write_stream(ss);
+	}
+	catch (const std::logic_error&) {
+		return true;
+	}
+	return false;
+}
+
+int main() {
+	int num_failed = 0;
+	for (const size_t num_threads : { 1, 4 }) {
+		for (const bool dedupe : { false, true }) {
+			for (const size_t bad_frame : { 0, 500, 999 }) {
+				if (!throws_logic_error(num_threads, dedupe, bad_frame)) {
+					std::cerr << "no exception with " << num_threads << " threads, dedupe " << dedupe
+						<< ", bad frame " << bad_frame << "\n";
+					++num_failed;
+				}
+			}
+		}
+	}
+	return num_failed == 0 ? 0 : 1;
+}
@@ -34,10 +34,24 @@ SOFTWARE.
 #include <memory>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
 #include <cmath>
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
 
 namespace HtmlAnim {
 
@@ -84,6 +98,93 @@ Vec2 operator*(const Vec2& lhs, const CoordType& rhs) {return Vec2{lhs.x * rhs,
 
 using Vec2Vector = std::vector<Vec2>;
 
+/// Axis-aligned box, a default constructed box stands for an unknown extent
+struct BoundingBox {
+	bool known = false;
+	Vec2 min, max;
+
+	BoundingBox() {}
+	explicit BoundingBox(CoordType x0, CoordType y0, CoordType x1, CoordType y1)
+		: known{ true }, min{ std::min(x0, x1), std::min(y0, y1) }, max{ std::max(x0, x1), std::max(y0, y1) } {}
+
+	/// Known to cover nothing, for drawables that only change context state
+	static BoundingBox empty() {
+		BoundingBox box(0, 0, 0, 0);
+		box.min = Vec2(1, 1);
+		return box;
+	}
+	bool is_empty() const { return known && (min.x > max.x || min.y > max.y); }
+
+	void add(const Vec2& p) {
+		if (!known || is_empty()) {
+			known = true;
+			min = p;
+			max = p;
+			return;
+		}
+		min.x = std::min(min.x, p.x);
+		min.y = std::min(min.y, p.y);
+		max.x = std::max(max.x, p.x);
+		max.y = std::max(max.y, p.y);
+	}
+
+	void add(const BoundingBox& box) {
+		if (box.known && !box.is_empty()) {
+			add(box.min);
+			add(box.max);
+		}
+	}
+
+	void expand(CoordType margin) {
+		min -= Vec2(margin, margin);
+		max += Vec2(margin, margin);
+	}
+
+	bool intersects(const BoundingBox& other) const {
+		return min.x <= other.max.x && other.min.x <= max.x && min.y <= other.max.y && other.min.y <= max.y;
+	}
+};
+
+/// Canvas transform matrix, maps (x, y) to (a * x + c * y + e, b * x + d * y + f)
+struct Transform2D {
+	CoordType a = 1, b = 0, c = 0, d = 1, e = 0, f = 0;
+
+	bool is_identity() const { return a == 1 && b == 0 && c == 0 && d == 1 && e == 0 && f == 0; }
+
+	void translate(CoordType x, CoordType y) {
+		e += a * x + c * y;
+		f += b * x + d * y;
+	}
+
+	void scale(CoordType x, CoordType y) {
+		a *= x;
+		b *= x;
+		c *= y;
+		d *= y;
+	}
+
+	void rotate(CoordType angle) {
+		const auto cos_a = std::cos(angle);
+		const auto sin_a = std::sin(angle);
+		const Transform2D t = *this;
+		a = t.a * cos_a + t.c * sin_a;
+		b = t.b * cos_a + t.d * sin_a;
+		c = t.c * cos_a - t.a * sin_a;
+		d = t.d * cos_a - t.b * sin_a;
+	}
+
+	Vec2 apply(const Vec2& p) const { return Vec2(a * p.x + c * p.y + e, b * p.x + d * p.y + f); }
+
+	BoundingBox apply(const BoundingBox& box) const {
+		BoundingBox result;
+		result.add(apply(box.min));
+		result.add(apply(box.max));
+		result.add(apply(Vec2(box.min.x, box.max.y)));
+		result.add(apply(Vec2(box.max.x, box.min.y)));
+		return result;
+	}
+};
+
 using SizeType = unsigned int;
 
 constexpr SizeType FPS = 60;
@@ -95,16 +196,233 @@ std::string rgb_color(SizeType r, SizeType g, SizeType b) {
 	return ss.str();
 }
 
+std::string base64_encode(const unsigned char* data, size_t size) {
+	static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string result;
+	result.reserve((size + 2) / 3 * 4);
+	size_t i = 0;
+	for (; i + 2 < size; i += 3) {
+		const auto n = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		result += digits[(n >> 18) & 63];
+		result += digits[(n >> 12) & 63];
+		result += digits[(n >> 6) & 63];
+		result += digits[n & 63];
+	}
+	if (i < size) {
+		const auto n = (data[i] << 16) | ((i + 1 < size) ? (data[i + 1] << 8) : 0);
+		result += digits[(n >> 18) & 63];
+		result += digits[(n >> 12) & 63];
+		result += (i + 1 < size) ? digits[(n >> 6) & 63] : '=';
+		result += '=';
+	}
+	return result;
+}
+
+/// Little endian float32 bytes of values, as expected by a JS Float32Array
+std::string base64_encode_floats(const std::vector<float>& values) {
+	std::vector<unsigned char> bytes(values.size() * 4);
+	for (size_t i = 0; i < values.size(); ++i) {
+		uint32_t bits;
+		std::memcpy(&bits, &values[i], 4);
+		for (size_t b = 0; b < 4; ++b)
+			bytes[i * 4 + b] = static_cast<unsigned char>(bits >> (8 * b));
+	}
+	return base64_encode(bytes.data(), bytes.size());
+}
+
+/// JS string literal for s
+std::string js_string(const std::string& s) {
+	std::string result = "\"";
+	for (const auto c : s) {
+		switch (c) {
+		case '"': result += "\\\""; break;
+		case '\\': result += "\\\\"; break;
+		case '\n': result += "\\n"; break;
+		case '\r': result += "\\r"; break;
+		case '<': result += "\\x3c"; break;
+		default: result += c;
+		}
+	}
+	return result + "\"";
+}
+
+/// Shortest text that reads back as v, independent of the locale. buf must hold 32 chars
+size_t format_number(char* buf, CoordType v) {
+	if (std::isnan(v)) {
+		std::memcpy(buf, "NaN", 3);
+		return 3;
+	}
+	if (std::isinf(v)) {
+		if (v < 0) {
+			std::memcpy(buf, "-Infinity", 9);
+			return 9;
+		}
+		std::memcpy(buf, "Infinity", 8);
+		return 8;
+	}
+	if (v == std::trunc(v) && std::fabs(v) < 1e15) {
+		const auto n = static_cast<long long>(v);
+		auto u = static_cast<unsigned long long>(n < 0 ? -n : n);
+		char digits[20];
+		size_t n_digits = 0;
+		do {
+			digits[n_digits++] = static_cast<char>('0' + u % 10);
+			u /= 10;
+		} while (u);
+		size_t len = 0;
+		if (n < 0)
+			buf[len++] = '-';
+		while (n_digits)
+			buf[len++] = digits[--n_digits];
+		return len;
+	}
+	// Few decimals: m / 10^k is correctly rounded like strtod of the digits, so the check is exact
+	static const CoordType powers_of_10[] = { 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8 };
+	if (std::fabs(v) < 1e7) {
+		for (size_t k = 0; k < 8; ++k) {
+			const auto m = std::round(v * powers_of_10[k]);
+			if (m / powers_of_10[k] != v)
+				continue;
+			auto u = static_cast<unsigned long long>(std::fabs(m));
+			char digits[20];
+			size_t n_digits = 0;
+			for (size_t d = 0; d <= k || u; ++d) {
+				digits[n_digits++] = static_cast<char>('0' + u % 10);
+				u /= 10;
+				if (d == k)
+					digits[n_digits++] = '.';
+			}
+			size_t len = 0;
+			if (v < 0)
+				buf[len++] = '-';
+			if (digits[n_digits - 1] == '.')
+				buf[len++] = '0';
+			while (n_digits)
+				buf[len++] = digits[--n_digits];
+			return len;
+		}
+	}
+	int len = 0;
+	for (int precision = 15; precision <= 17; ++precision) {
+		len = std::snprintf(buf, 32, "%.*g", precision, v);
+		if (precision == 17 || std::strtod(buf, nullptr) == v)
+			break;
+	}
+	for (int i = 0; i < len; ++i) {
+		if (buf[i] == ',')
+			buf[i] = '.';
+	}
+	return static_cast<size_t>(len);
+}
+
+/// Growable output buffer with fast number formatting. Flushed in bulk when it targets a file or stream
+class OutputSink {
+	static constexpr size_t flush_size = 1 << 20;
+
+	std::string buffer;
+	std::FILE* file = nullptr;
+	std::ostream* stream = nullptr;
+
+	void check_flush() {
+		if (buffer.size() >= flush_size && (file || stream))
+			flush();
+	}
+
+public:
+	OutputSink() = default;
+	explicit OutputSink(std::FILE* file) : file{ file } {}
+	explicit OutputSink(std::ostream& os) : stream{ &os } {}
+	OutputSink(const OutputSink&) = delete;
+	OutputSink& operator=(const OutputSink&) = delete;
+	~OutputSink() { flush(); }
+
+	OutputSink& append(const char* s, size_t n) {
+		buffer.append(s, n);
+		check_flush();
+		return *this;
+	}
+	OutputSink& append(const char* s) { return append(s, std::strlen(s)); }
+	OutputSink& append(const std::string& s) { return append(s.data(), s.size()); }
+	OutputSink& append(const OutputSink& other) { return append(other.data(), other.size()); }
+	OutputSink& append(char c) {
+		buffer.push_back(c);
+		check_flush();
+		return *this;
+	}
+
+	OutputSink& append_number(CoordType v) {
+		const auto old_size = buffer.size();
+		buffer.resize(old_size + 32);
+		buffer.resize(old_size + format_number(&buffer[old_size], v));
+		check_flush();
+		return *this;
+	}
+
+	template<typename T>
+	OutputSink& append_integer(T v) {
+		char digits[24];
+		size_t n_digits = 0;
+		const bool negative = v < 0;
+		auto u = negative ? 0 - static_cast<unsigned long long>(v) : static_cast<unsigned long long>(v);
+		do {
+			digits[n_digits++] = static_cast<char>('0' + u % 10);
+			u /= 10;
+		} while (u);
+		if (negative)
+			buffer.push_back('-');
+		while (n_digits)
+			buffer.push_back(digits[--n_digits]);
+		check_flush();
+		return *this;
+	}
+
+	/// Write the buffer to the file or stream, a memory-only sink keeps it
+	void flush() {
+		if (buffer.empty())
+			return;
+		if (file)
+			std::fwrite(buffer.data(), 1, buffer.size(), file);
+		else if (stream)
+			stream->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		else
+			return;
+		buffer.clear();
+	}
+
+	const char* data() const { return buffer.data(); }
+	size_t size() const { return buffer.size(); }
+	bool empty() const { return buffer.empty(); }
+	std::string str() const { return buffer; }
+	std::string take() {
+		std::string result;
+		result.swap(buffer);
+		return result;
+	}
+	void clear() { buffer.clear(); }
+};
+
+OutputSink& operator<<(OutputSink& out, const char* s) { return out.append(s); }
+OutputSink& operator<<(OutputSink& out, const std::string& s) { return out.append(s); }
+OutputSink& operator<<(OutputSink& out, char c) { return out.append(c); }
+OutputSink& operator<<(OutputSink& out, double v) { return out.append_number(v); }
+OutputSink& operator<<(OutputSink& out, float v) { return out.append_number(v); }
+OutputSink& operator<<(OutputSink& out, int v) { return out.append_integer(v); }
+OutputSink& operator<<(OutputSink& out, unsigned int v) { return out.append_integer(v); }
+OutputSink& operator<<(OutputSink& out, long v) { return out.append_integer(v); }
+OutputSink& operator<<(OutputSink& out, unsigned long v) { return out.append_integer(v); }
+OutputSink& operator<<(OutputSink& out, long long v) { return out.append_integer(v); }
+OutputSink& operator<<(OutputSink& out, unsigned long long v) { return out.append_integer(v); }
+
 using HashType = size_t;
 using TypeHashSet = std::unordered_set<HashType>;
 
 class DefinitionsStream {
 private:
-	std::ostream &output_stream;
+	OutputSink &output_stream;
 	TypeHashSet defined_drawables;
 
 public:
-	explicit DefinitionsStream(std::ostream &os) : output_stream{os} {}
+	explicit DefinitionsStream(OutputSink &os) : output_stream{os} {}
 
 	bool is_drawable_defined(const HashType &hash) const {
 		return (defined_drawables.find(hash) != defined_drawables.end());
@@ -124,137 +442,712 @@ public:
 	auto& stream() {return output_stream;}
 };
 
+/// JS decoders for the output of base64_encode() and base64_encode_floats()
+struct Base64Decoder {
+	static void define(DefinitionsStream& ds) {
+		ds.write_if_undefined(typeid(Base64Decoder).hash_code(), R"(
+function unpack_base64(s) {
+	const b = atob(s);
+	const u = new Uint8Array(b.length);
+	for(let i = 0; i < b.length; ++i)
+		u[i] = b.charCodeAt(i);
+	return u;
+}
+
+const float32_arrays = new Map();
+function unpack_float32(s) {
+	let v = float32_arrays.get(s);
+	if(v === undefined) {
+		v = new Float32Array(unpack_base64(s).buffer);
+		float32_arrays.set(s, v);
+	}
+	return v;
+}
+)");
+	}
+};
+
+/// Bump allocator owning the drawables and expressions of a layer, released all at once
+class Arena {
+	static constexpr size_t block_size = 64 * 1024;
+
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+	std::vector<Block> blocks;
+	size_t cur_block = 0;
+	size_t offset = 0;
+
+public:
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t align) {
+		while (cur_block < blocks.size()) {
+			auto& blk = blocks[cur_block];
+			const auto start = (offset + align - 1) & ~(align - 1);
+			if (start + size <= blk.size) {
+				offset = start + size;
+				return blk.data.get() + start;
+			}
+			++cur_block;
+			offset = 0;
+		}
+		const auto new_size = (size > block_size) ? size : block_size;
+		blocks.push_back(Block{ std::unique_ptr<char[]>(new char[new_size]), new_size });
+		offset = size;
+		return blocks.back().data.get();
+	}
+
+	template<typename T, typename... Args>
+	T* create(Args&&... args) {
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned type in Arena");
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	/// All objects created in the arena must have been destroyed. Keeps the first block for reuse
+	void release() {
+		if (blocks.size() > 1)
+			blocks.resize(1);
+		cur_block = 0;
+		offset = 0;
+	}
+
+	auto get_num_blocks() const { return blocks.size(); }
+};
+
+/// Deletes heap objects, only runs the destructor of objects placed in an Arena
+struct ArenaDeleter {
+	bool in_arena = false;
+
+	ArenaDeleter() = default;
+	explicit ArenaDeleter(bool in_arena) : in_arena{ in_arena } {}
+	template<typename T> ArenaDeleter(const std::default_delete<T>&) {}
+
+	template<typename T> void operator()(T* p) const {
+		if (in_arena)
+			p->~T();
+		else
+			delete p;
+	}
+};
+
+class FrameEncoder;
+
 class Drawable {
 public:
 	virtual ~Drawable() {}
 
 	virtual void define(DefinitionsStream&) const {}
-	virtual void draw(std::ostream &os) const = 0;
+	virtual void draw(OutputSink &os) const = 0;
+	/// Writes through draw(OutputSink&)
+	void draw(std::ostream &os) const {
+		OutputSink out;
+		draw(out);
+		os.write(out.data(), static_cast<std::streamsize>(out.size()));
+	}
+	/// Append to the compact frame encoding, return false if this drawable can't be encoded
+	virtual bool encode(FrameEncoder&) const { return false; }
+	/// Extent of the static geometry in the current coordinate system, unknown by default
+	virtual BoundingBox bounds() const { return BoundingBox(); }
+	/// Apply the change to the canvas transform, return false if it is not statically known
+	virtual bool transform(Transform2D&) const { return true; }
 };
 
+/// Either a literal or the name of a JS variable. Literals are only formatted when written
 class ExpressionValue {
 protected:
-	std::string str_val;
+	enum class Kind { Number, Boolean, Reference };
+	Kind kind;
+	CoordType num_val;
+	std::shared_ptr<const std::string> ref;
 public:
+	using Bindings = std::unordered_map<std::string, CoordType>;
+
+	/// Native values written in place of the references while a frame is baked on this thread
+	static const Bindings*& baked_values() {
+		thread_local const Bindings* values = nullptr;
+		return values;
+	}
+
 	virtual ~ExpressionValue() = default;
-	ExpressionValue(const std::string& v) : str_val{ v } {}
-	virtual const std::string& to_string() const { return str_val; }
+	ExpressionValue(const std::string& v) : kind{ Kind::Reference }, num_val{ 0 }, ref{ std::make_shared<const std::string>(v) } {}
+	ExpressionValue(CoordType v) : kind{ Kind::Number }, num_val{ v } {}
+	ExpressionValue(bool b) : kind{ Kind::Boolean }, num_val{ b ? 1.0 : 0.0 } {}
+
+	bool is_literal() const { return kind != Kind::Reference; }
+	CoordType get_number() const { return num_val; }
+
+	/// Value of a reference in the baked values, false if there is none
+	bool get_baked(CoordType& v) const {
+		const auto values = baked_values();
+		if (kind != Kind::Reference || !values)
+			return false;
+		const auto found = values->find(*ref);
+		if (found == values->end())
+			return false;
+		v = found->second;
+		return true;
+	}
+
+	std::string to_string() const {
+		OutputSink out;
+		write(out);
+		return out.take();
+	}
+
+	void write(OutputSink& os) const {
+		switch (kind) {
+		case Kind::Number: os.append_number(num_val); break;
+		case Kind::Boolean: os << (num_val != 0 ? "true" : "false"); break;
+		case Kind::Reference: {
+			CoordType v;
+			if (get_baked(v))
+				os.append_number(v);
+			else
+				os << *ref;
+			break;
+		}
+		}
+	}
 };
 
+OutputSink& operator<<(OutputSink& os, const ExpressionValue& v) {
+	v.write(os);
+	return os;
+}
+
+std::ostream& operator<<(std::ostream& os, const ExpressionValue& v) {
+	return os << v.to_string();
+}
+
 class CoordExpressionValue : public ExpressionValue {
 public:
 	CoordExpressionValue(const std::string& v) : ExpressionValue{ v } {}
-	template<typename T> CoordExpressionValue(const T& v) : ExpressionValue{ std::to_string(v) } {}
+	template<typename T> CoordExpressionValue(const T& v) : ExpressionValue{ static_cast<CoordType>(v) } {}
 };
 
 class BoolExpressionValue : public ExpressionValue {
 public:
 	BoolExpressionValue(const std::string& v) : ExpressionValue{ v } {}
-	BoolExpressionValue(const bool& b) : ExpressionValue{ (b ? "true" : "false") } {}
+	BoolExpressionValue(const bool& b) : ExpressionValue{ b } {}
 };
 
 class PointExpressionValue : public ExpressionValue {
 	std::string str_val_2;
 public:
 	PointExpressionValue(const std::string& v, const std::string& v2) : ExpressionValue{ v }, str_val_2{ v2 } {}
-	virtual const std::string& to_string_2() const { return str_val_2; }
+	const std::string& to_string_2() const { return str_val_2; }
+};
+
+/// JS helpers called by the written frames, marked from any writer thread
+struct UsedHelpers {
+	std::atomic<bool> packed_frame{ false };
+	std::atomic<bool> expand_frames{ false };
+	std::atomic<bool> delta_frame{ false };
+	std::atomic<bool> stroke_paths{ false };
+	std::atomic<bool> baked_frame{ false };
+};
+
+/// Opcodes and float32 operands of a frame, replayed by a fixed JS interpreter
+class FrameEncoder {
+	std::vector<unsigned char> ops;
+	std::vector<float> args;
+	std::vector<std::string> refs;
+
+public:
+	enum Op : unsigned char {
+		ARC, RECT, LINE, PATH, FILL_STYLE, STROKE_STYLE, FONT, LINE_CAP, LINE_WIDTH,
+		TEXT, SCALE, ROTATE, TRANSLATE, SAVE, RESTORE, CALL_MACRO, DRAW_IMAGE, STROKE_PATHS, POLYLINE,
+		MACRO_INSTANCES
+	};
+
+	static void define(DefinitionsStream& ds) {
+		Base64Decoder::define(ds);
+		ds.write_if_undefined(typeid(FrameEncoder).hash_code(), R"(
+function packed_frame(ops, args, refs, int16) {
+	let code = null, v = null;
+	return function(ctx, layer) {
+		if(code === null) {
+			code = unpack_base64(ops);
+			const buffer = unpack_base64(args).buffer;
+			v = int16 ? new Int16Array(buffer) : new Float32Array(buffer);
+		}
+		let a = 0;
+		for(let i = 0; i < code.length; ++i) {
+			switch(code[i]) {
+			case 0: arc(ctx, v[a], v[a+1], v[a+2], v[a+3], v[a+4], v[a+5]); a += 6; break;
+			case 1: rect(ctx, v[a], v[a+1], v[a+2], v[a+3], v[a+4]); a += 5; break;
+			case 2: line(ctx, v[a], v[a+1], v[a+2], v[a+3]); a += 4; break;
+			case 3: {
+				const n = v[a], close = v[a+1], fill = v[a+2];
+				a += 3;
+				ctx.beginPath();
+				ctx.moveTo(v[a], v[a+1]);
+				for(let p = 1; p < n; ++p)
+					ctx.lineTo(v[a+2*p], v[a+2*p+1]);
+				a += 2 * n;
+				if(close)
+					ctx.closePath();
+				if(fill)
+					ctx.fill();
+				else
+					ctx.stroke();
+				break;
+			}
+			case 4: ctx.fillStyle = refs[v[a++]]; break;
+			case 5: ctx.strokeStyle = refs[v[a++]]; break;
+			case 6: ctx.font = refs[v[a++]]; break;
+			case 7: ctx.lineCap = refs[v[a++]]; break;
+			case 8: ctx.lineWidth = v[a++]; break;
+			case 9: text(ctx, v[a], v[a+1], refs[v[a+2]], v[a+3]); a += 4; break;
+			case 10: ctx.scale(v[a], v[a+1]); a += 2; break;
+			case 11: ctx.rotate(v[a++]); break;
+			case 12: ctx.translate(v[a], v[a+1]); a += 2; break;
+			case 13: ctx.save(); break;
+			case 14: ctx.restore(); break;
+			case 15: refs[v[a++]](ctx); break;
+			case 16: ctx.drawImage(surfaces[v[a]], v[a+1], v[a+2], v[a+3], v[a+4], v[a+5], v[a+6], v[a+7], v[a+8]); a += 9; break;
+			case 17: stroke_paths(ctx, v.subarray(a + 1, a + 1 + v[a])); a += 1 + v[a]; break;
+			case 18: polyline(ctx, refs[v[a]], v[a+1], v[a+2]); a += 3; break;
+			case 19: macro_instances(ctx, refs[v[a]], refs[v[a+1]]); a += 2; break;
+			}
+		}
+	};
+}
+)");
+	}
+
+	void op(Op o) { ops.push_back(o); }
+	void number(CoordType v) { args.push_back(static_cast<float>(v)); }
+
+	bool value(const ExpressionValue& v) {
+		CoordType baked;
+		if (v.get_baked(baked)) {
+			number(baked);
+			return true;
+		}
+		if (!v.is_literal())
+			return false;
+		number(v.get_number());
+		return true;
+	}
+
+	/// Operand that indexes a JS expression in the frame's reference table
+	void reference(const std::string& js) {
+		const auto found = std::find(refs.begin(), refs.end(), js);
+		number(static_cast<CoordType>(found - refs.begin()));
+		if (found == refs.end())
+			refs.push_back(js);
+	}
+	void string(const std::string& s) { reference(js_string(s)); }
+
+	/// Operands are written as int16 if they are all small integers, otherwise as float32
+	void write(OutputSink& os, UsedHelpers& used) const {
+		used.packed_frame = true;
+		const bool int16 = std::all_of(args.begin(), args.end(),
+			[](float v) {return v == std::trunc(v) && v >= -32768 && v <= 32767;});
+		os << "packed_frame(\"" << base64_encode(ops.data(), ops.size()) << "\", \"";
+		if (int16) {
+			std::vector<unsigned char> bytes(args.size() * 2);
+			for (size_t i = 0; i < args.size(); ++i) {
+				const auto bits = static_cast<uint16_t>(static_cast<int16_t>(args[i]));
+				bytes[i * 2] = static_cast<unsigned char>(bits);
+				bytes[i * 2 + 1] = static_cast<unsigned char>(bits >> 8);
+			}
+			os << base64_encode(bytes.data(), bytes.size());
+		}
+		else {
+			os << base64_encode_floats(args);
+		}
+		os << "\", [";
+		for (size_t i = 0; i < refs.size(); ++i) {
+			os << (i ? ", " : "") << refs[i];
+		}
+		os << "]" << (int16 ? ", true)" : ")");
+	}
+
+	void clear() {
+		ops.clear();
+		args.clear();
+		refs.clear();
+	}
+};
+
+/// Node of a Formula, immutable so that formulas can share subtrees
+struct FormulaNode {
+	enum class Kind { Constant, Variable, Tick, Reference, Negate, Add, Subtract, Multiply, Divide, Power, Min, Max, Sin, Cos, Sqrt, Abs };
+	Kind kind;
+	CoordType value = 0;
+	std::string name;
+	std::shared_ptr<const FormulaNode> a, b;
+
+	explicit FormulaNode(Kind kind) : kind{ kind } {}
+};
+
+/// Arithmetic on numbers, expression values, the tick counter and a free variable X.
+/// Constant parts are folded when the formula is built, the rest is written as JS or evaluated natively
+class Formula {
+	using Kind = FormulaNode::Kind;
+	std::shared_ptr<const FormulaNode> node;
+
+	explicit Formula(std::shared_ptr<const FormulaNode>&& node) : node{ std::move(node) } {}
+
+	static Formula leaf(Kind kind, const std::string& name = std::string()) {
+		auto n = std::make_shared<FormulaNode>(kind);
+		n->name = name;
+		return Formula(std::move(n));
+	}
+
+	bool is(CoordType v) const { return is_constant() && node->value == v; }
+
+	static int precedence(const FormulaNode& n) {
+		switch (n.kind) {
+		case Kind::Constant: return n.value < 0 ? 3 : 4;
+		case Kind::Add: case Kind::Subtract: return 1;
+		case Kind::Multiply: case Kind::Divide: return 2;
+		case Kind::Negate: return 3;
+		default: return 4;
+		}
+	}
+
+	static void write_call(OutputSink& os, const char* fn, const FormulaNode& n) {
+		os << fn << "(";
+		write(os, *n.a, 0);
+		if (n.b) {
+			os << ", ";
+			write(os, *n.b, 0);
+		}
+		os << ")";
+	}
+
+	static void write(OutputSink& os, const FormulaNode& n, int min_precedence) {
+		const bool parens = precedence(n) < min_precedence;
+		if (parens)
+			os << "(";
+		switch (n.kind) {
+		case Kind::Constant: os.append_number(n.value); break;
+		case Kind::Variable: throw std::logic_error("Formula variable X was not substituted");
+		case Kind::Tick: os << "layer.tick"; break;
+		case Kind::Reference: os << n.name; break;
+		case Kind::Negate: os << "-"; write(os, *n.a, 4); break;
+		case Kind::Add:
+			write(os, *n.a, 1);
+			if (n.b->kind == Kind::Constant && n.b->value < 0) {
+				os << " - ";
+				os.append_number(-n.b->value);
+			}
+			else {
+				os << " + ";
+				write(os, *n.b, 2);
+			}
+			break;
+		case Kind::Subtract: write(os, *n.a, 1); os << " - "; write(os, *n.b, 2); break;
+		case Kind::Multiply: write(os, *n.a, 2); os << " * "; write(os, *n.b, 3); break;
+		case Kind::Divide: write(os, *n.a, 2); os << " / "; write(os, *n.b, 3); break;
+		case Kind::Power: write_call(os, "Math.pow", n); break;
+		case Kind::Min: write_call(os, "Math.min", n); break;
+		case Kind::Max: write_call(os, "Math.max", n); break;
+		case Kind::Sin: write_call(os, "Math.sin", n); break;
+		case Kind::Cos: write_call(os, "Math.cos", n); break;
+		case Kind::Sqrt: write_call(os, "Math.sqrt", n); break;
+		case Kind::Abs: write_call(os, "Math.abs", n); break;
+		}
+		if (parens)
+			os << ")";
+	}
+
+	static CoordType evaluate(const FormulaNode& n, CoordType x, CoordType tick, const ExpressionValue::Bindings* values = nullptr) {
+		switch (n.kind) {
+		case Kind::Constant: return n.value;
+		case Kind::Variable: return x;
+		case Kind::Tick: return tick;
+		case Kind::Reference: {
+			if (values) {
+				const auto found = values->find(n.name);
+				if (found != values->end())
+					return found->second;
+			}
+			throw std::logic_error("Cannot evaluate JS variable " + n.name);
+		}
+		case Kind::Negate: return -evaluate(*n.a, x, tick, values);
+		case Kind::Add: return evaluate(*n.a, x, tick, values) + evaluate(*n.b, x, tick, values);
+		case Kind::Subtract: return evaluate(*n.a, x, tick, values) - evaluate(*n.b, x, tick, values);
+		case Kind::Multiply: return evaluate(*n.a, x, tick, values) * evaluate(*n.b, x, tick, values);
+		case Kind::Divide: return evaluate(*n.a, x, tick, values) / evaluate(*n.b, x, tick, values);
+		case Kind::Power: return std::pow(evaluate(*n.a, x, tick, values), evaluate(*n.b, x, tick, values));
+		case Kind::Min: return std::min(evaluate(*n.a, x, tick, values), evaluate(*n.b, x, tick, values));
+		case Kind::Max: return std::max(evaluate(*n.a, x, tick, values), evaluate(*n.b, x, tick, values));
+		case Kind::Sin: return std::sin(evaluate(*n.a, x, tick, values));
+		case Kind::Cos: return std::cos(evaluate(*n.a, x, tick, values));
+		case Kind::Sqrt: return std::sqrt(evaluate(*n.a, x, tick, values));
+		case Kind::Abs: return std::abs(evaluate(*n.a, x, tick, values));
+		}
+		return 0;
+	}
+
+	/// Folds constant operands and identities like x * 1 and x + 0
+	static Formula make(Kind kind, const Formula& a, const Formula& b = Formula(0.0)) {
+		const bool binary = kind != Kind::Negate && kind < Kind::Sin;
+		if (a.is_constant() && (!binary || b.is_constant())) {
+			FormulaNode n(kind);
+			n.a = a.node;
+			n.b = b.node;
+			return Formula(evaluate(n, 0, 0));
+		}
+		switch (kind) {
+		case Kind::Negate:
+			if (a.node->kind == Kind::Negate)
+				return Formula(std::shared_ptr<const FormulaNode>(a.node->a));
+			break;
+		case Kind::Add:
+			if (a.is(0)) return b;
+			if (b.is(0)) return a;
+			break;
+		case Kind::Subtract:
+			if (b.is(0)) return a;
+			if (a.is(0)) return make(Kind::Negate, b);
+			break;
+		case Kind::Multiply:
+			if (a.is(1)) return b;
+			if (b.is(1)) return a;
+			if (a.is(0) || b.is(0)) return Formula(0.0);
+			break;
+		case Kind::Divide:
+		case Kind::Power:
+			if (b.is(1)) return a;
+			if (kind == Kind::Power && b.is(0)) return Formula(1.0);
+			break;
+		default:
+			break;
+		}
+		auto n = std::make_shared<FormulaNode>(kind);
+		n->a = a.node;
+		if (binary)
+			n->b = b.node;
+		return Formula(std::move(n));
+	}
+
+	static bool can_evaluate(const FormulaNode& n, const ExpressionValue::Bindings& values) {
+		if (n.kind == Kind::Reference)
+			return values.count(n.name) > 0;
+		return (!n.a || can_evaluate(*n.a, values)) && (!n.b || can_evaluate(*n.b, values));
+	}
+
+	static Formula substitute(const std::shared_ptr<const FormulaNode>& n, const Formula& x) {
+		switch (n->kind) {
+		case Kind::Variable: return x;
+		case Kind::Constant: case Kind::Tick: case Kind::Reference: return Formula(std::shared_ptr<const FormulaNode>(n));
+		default:
+			return make(n->kind, substitute(n->a, x), n->b ? substitute(n->b, x) : Formula(0.0));
+		}
+	}
+
+public:
+	Formula(CoordType v) {
+		auto n = std::make_shared<FormulaNode>(Kind::Constant);
+		n->value = v;
+		node = std::move(n);
+	}
+	/// Literals become constants, references stay JS variables
+	Formula(const ExpressionValue& v) : Formula{ v.is_literal() ? Formula(v.get_number()) : reference(v.to_string()) } {}
+
+	/// The free variable X, replaced by substitute()
+	static Formula variable() { return leaf(Kind::Variable); }
+	/// Ticks the current frame has been shown
+	static Formula tick() { return leaf(Kind::Tick); }
+	static Formula reference(const std::string& js_name) { return leaf(Kind::Reference, js_name); }
+
+	bool is_constant() const { return node->kind == Kind::Constant; }
+	CoordType get_number() const { return node->value; }
+
+	/// JS variables are looked up in values, evaluating an unknown one throws
+	CoordType evaluate(CoordType x = 0, CoordType tick = 0, const ExpressionValue::Bindings* values = nullptr) const {
+		return evaluate(*node, x, tick, values);
+	}
+	/// True if every JS variable in the formula has a value
+	bool can_evaluate(const ExpressionValue::Bindings& values) const { return can_evaluate(*node, values); }
+	Formula substitute(const Formula& x) const { return substitute(node, x); }
+
+	void write(OutputSink& os) const { write(os, *node, 0); }
+	std::string to_string() const {
+		OutputSink out;
+		write(out);
+		return out.take();
+	}
+
+	friend Formula operator-(const Formula& a) { return make(Kind::Negate, a); }
+	friend Formula operator+(const Formula& a, const Formula& b) { return make(Kind::Add, a, b); }
+	friend Formula operator-(const Formula& a, const Formula& b) { return make(Kind::Subtract, a, b); }
+	friend Formula operator*(const Formula& a, const Formula& b) { return make(Kind::Multiply, a, b); }
+	friend Formula operator/(const Formula& a, const Formula& b) { return make(Kind::Divide, a, b); }
+	friend Formula pow(const Formula& a, const Formula& b) { return make(Kind::Power, a, b); }
+	friend Formula min(const Formula& a, const Formula& b) { return make(Kind::Min, a, b); }
+	friend Formula max(const Formula& a, const Formula& b) { return make(Kind::Max, a, b); }
+	friend Formula sin(const Formula& a) { return make(Kind::Sin, a); }
+	friend Formula cos(const Formula& a) { return make(Kind::Cos, a); }
+	friend Formula sqrt(const Formula& a) { return make(Kind::Sqrt, a); }
+	friend Formula abs(const Formula& a) { return make(Kind::Abs, a); }
 };
 
+OutputSink& operator<<(OutputSink& os, const Formula& f) {
+	f.write(os);
+	return os;
+}
+
 class Expression {
 public:
 	virtual ~Expression() {}
 
-	virtual void init(std::ostream& os) const {}
-	virtual void exit(std::ostream& os) const {}
+	virtual void init(OutputSink& os) const = 0;
+	virtual void exit(OutputSink& os) const = 0;
+	/// Write through the OutputSink overloads
+	void init(std::ostream& os) const {
+		OutputSink out;
+		init(out);
+		os.write(out.data(), static_cast<std::streamsize>(out.size()));
+	}
+	void exit(std::ostream& os) const {
+		OutputSink out;
+		exit(out);
+		os.write(out.data(), static_cast<std::streamsize>(out.size()));
+	}
 
 	virtual const ExpressionValue& value() const = 0;
+
+	/// Extra ticks the expression holds its frame for
+	virtual SizeType hold_ticks() const { return 0; }
+	/// Adds the native values of the expression's variables at tick, false if only JS can compute them
+	virtual bool evaluate(SizeType, ExpressionValue::Bindings&) const { return false; }
 };
 
 class LinearRangeExpression : public Expression {
 	CoordType start, stop;
 	SizeType steps;
 	CoordExpressionValue var_name;
-	static SizeType count;
 public:
-	LinearRangeExpression(CoordType start, CoordType stop, SizeType steps)
+	/// id names the variable, it must be unique among the expressions of a top-level frame
+	LinearRangeExpression(CoordType start, CoordType stop, SizeType steps, SizeType id)
 		: start{ start }, stop{ stop }, steps{ steps },
-		var_name{ std::string("layer.expressions.linear_range_") + std::to_string(count++) } {}
-	virtual void init(std::ostream& os) const override {
-		os << "if(" << var_name.to_string() << " == null) " << var_name.to_string() << " = " << start << ";\n";
-	}
-	virtual void exit(std::ostream& os) const override {
-		if (start < stop) {
-			const auto inc = (stop - start) / steps;
-			os << "if(" << var_name.to_string() << " < " << stop << ") {\n"
-				<< var_name.to_string() << " += " << inc << ";\n"
-				<< "layer.repeat_current_frame = true;\n"
-				<< "}\n"
-				<< "if (" << var_name.to_string() << " > " << stop << ") {\n"
-				<< var_name.to_string() << " = " << stop << ";\n"
-				<< "}\n";
-		}
-		else {
-			const auto inc = (start - stop) / steps;
-			os << "if(" << var_name.to_string() << " > " << stop << ") {\n"
-				<< var_name.to_string() << " -= " << inc << ";\n"
-				<< "layer.repeat_current_frame = true;\n"
-				<< "}\n"
-				<< "if (" << var_name.to_string() << " < " << stop << ") {\n"
-				<< var_name.to_string() << " = " << stop << ";\n"
-				<< "}\n";
-		}
+		var_name{ std::string("linear_range_") + std::to_string(id) } {}
+	virtual void init(OutputSink& os) const override {
+		os << "var " << var_name << " = " << closed_form(start, stop, steps) << ";\n";
+	}
+	/// The top-level frame writes the repeat test for all its expressions, see Frame::draw_with
+	virtual void exit(OutputSink&) const override {}
+
+	virtual SizeType hold_ticks() const override { return is_constant(start, stop, steps) ? 0 : steps; }
+	virtual bool evaluate(SizeType tick, ExpressionValue::Bindings& values) const override {
+		values[var_name.to_string()] = closed_form(start, stop, steps).evaluate(0, tick);
+		return true;
+	}
+
+	/// Constant ranges do not hold their frame
+	static bool is_constant(CoordType start, CoordType stop, SizeType steps) { return steps == 0 || start == stop; }
+	/// The value as a function of the ticks the frame has been shown, so it does not drift
+	static Formula closed_form(CoordType start, CoordType stop, SizeType steps) {
+		if (is_constant(start, stop, steps))
+			return Formula(stop);
+		return start + (stop - start) * min(Formula::tick() / steps, 1);
 	}
 	virtual const ExpressionValue& value() const override { return var_name; }
 };
-SizeType LinearRangeExpression::count = 0;
+
+/// Holds its frame for n_frames extra ticks, nothing reads its value
+class WaitExpression : public LinearRangeExpression {
+	SizeType n_frames;
+public:
+	WaitExpression(SizeType n_frames, SizeType id) : LinearRangeExpression(0, n_frames, n_frames, id), n_frames{ n_frames } {}
+	SizeType get_frames() const { return n_frames; }
+};
+
+/// Value of a formula, written as a literal when it folds to a constant.
+/// It holds its frame for hold_ticks extra ticks like the range it was built from
+class FormulaExpression : public Expression {
+	Formula formula;
+	SizeType hold;
+	CoordExpressionValue var_name;
+public:
+	FormulaExpression(const Formula& formula, SizeType hold_ticks, SizeType id)
+		: formula{ formula }, hold{ hold_ticks },
+		var_name{ formula.is_constant() ? CoordExpressionValue(formula.get_number())
+			: CoordExpressionValue(std::string("formula_") + std::to_string(id)) } {}
+	virtual void init(OutputSink& os) const override {
+		if (!formula.is_constant())
+			os << "var " << var_name << " = " << formula << ";\n";
+	}
+	virtual void exit(OutputSink&) const override {}
+	virtual const ExpressionValue& value() const override { return var_name; }
+	virtual SizeType hold_ticks() const override { return hold; }
+	virtual bool evaluate(SizeType tick, ExpressionValue::Bindings& values) const override {
+		if (formula.is_constant())
+			return true;
+		if (!formula.can_evaluate(values))
+			return false;
+		values[var_name.to_string()] = formula.evaluate(0, tick, &values);
+		return true;
+	}
+	const Formula& get_formula() const { return formula; }
+};
 
 class LinearTransformExpression : public Expression {
 	LinearRangeExpression linear_range;
 	CoordExpressionValue transform_var_name;
 	std::string transform;
-	static SizeType count;
+
+	static bool is_identifier_char(char c) {
+		return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+	}
 public:
-	LinearTransformExpression(CoordType start, CoordType stop, SizeType steps, const std::string& transform)
-		: linear_range(start, stop, steps),
-		transform_var_name{ std::string("layer.expressions.linear_transform_") + std::to_string(count++) },
+	LinearTransformExpression(CoordType start, CoordType stop, SizeType steps, const std::string& transform, SizeType id)
+		: linear_range(start, stop, steps, id),
+		transform_var_name{ std::string("linear_transform_") + std::to_string(id) },
 		transform{ transform } {}
-	virtual void init(std::ostream& os) const override {
+	virtual void init(OutputSink& os) const override {
 		linear_range.init(os);
-		const auto& linear_var = linear_range.value().to_string();
-		std::stringstream transform_expression;
-		for (const auto& c : transform) {
-			if (c == 'X') {
-				transform_expression << linear_var;
+		os << "var " << transform_var_name << " = ";
+		// Only a standalone X is the variable, not the X in Math.max or obj.X
+		for (size_t i = 0; i < transform.size(); ++i) {
+			const auto c = transform[i];
+			if (c == 'X' && (i == 0 || (!is_identifier_char(transform[i - 1]) && transform[i - 1] != '.'))
+				&& (i + 1 == transform.size() || !is_identifier_char(transform[i + 1]))) {
+				os << linear_range.value();
 			}
 			else {
-				transform_expression << c;
+				os << c;
 			}
 		}
-		os << transform_var_name.to_string() << " = " << transform_expression.str() << ";\n";
+		os << ";\n";
 	}
-	virtual void exit(std::ostream& os) const override {
+	virtual void exit(OutputSink& os) const override {
 		linear_range.exit(os);
 	}
 	virtual const ExpressionValue& value() const override { return transform_var_name; }
+	virtual SizeType hold_ticks() const override { return linear_range.hold_ticks(); }
 };
-SizeType LinearTransformExpression::count = 0;
 
 class LinearPointExpression : public Expression {
 	LinearRangeExpression range_1, range_2;
 	PointExpressionValue point;
 public:
-	LinearPointExpression(const Vec2& start, const Vec2& stop, SizeType steps)
-		: range_1( start.x, stop.x, steps ), range_2( start.y, stop.y, steps ),
+	LinearPointExpression(const Vec2& start, const Vec2& stop, SizeType steps, SizeType id_1, SizeType id_2)
+		: range_1( start.x, stop.x, steps, id_1 ), range_2( start.y, stop.y, steps, id_2 ),
 		point(range_1.value().to_string(), range_2.value().to_string()) {}
-	virtual void init(std::ostream& os) const override {
+	virtual void init(OutputSink& os) const override {
 		range_1.init(os);
 		range_2.init(os);
 	}
-	virtual void exit(std::ostream& os) const override {
+	virtual void exit(OutputSink& os) const override {
 		range_1.exit(os);
 		range_2.exit(os);
 	}
 	virtual const ExpressionValue& value() const override { return point; }
+	virtual SizeType hold_ticks() const override { return std::max(range_1.hold_ticks(), range_2.hold_ticks()); }
+	virtual bool evaluate(SizeType tick, ExpressionValue::Bindings& values) const override {
+		return range_1.evaluate(tick, values) && range_2.evaluate(tick, values);
+	}
 };
 
 class LinearTransformPointExpression : public Expression {
@@ -262,18 +1155,19 @@ class LinearTransformPointExpression : public Expression {
 	PointExpressionValue point;
 public:
 	LinearTransformPointExpression(const Vec2& start, const Vec2& stop, SizeType steps,
-		const std::string& transform_x, const std::string& transform_y)
-		: range_1( start.x, stop.x, steps, transform_x ), range_2( start.y, stop.y, steps, transform_y ),
+		const std::string& transform_x, const std::string& transform_y, SizeType id_1, SizeType id_2)
+		: range_1( start.x, stop.x, steps, transform_x, id_1 ), range_2( start.y, stop.y, steps, transform_y, id_2 ),
 		point(range_1.value().to_string(), range_2.value().to_string()) {}
-	virtual void init(std::ostream& os) const override {
+	virtual void init(OutputSink& os) const override {
 		range_1.init(os);
 		range_2.init(os);
 	}
-	virtual void exit(std::ostream& os) const override {
+	virtual void exit(OutputSink& os) const override {
 		range_1.exit(os);
 		range_2.exit(os);
 	}
 	virtual const ExpressionValue& value() const override { return point; }
+	virtual SizeType hold_ticks() const override { return std::max(range_1.hold_ticks(), range_2.hold_ticks()); }
 };
 
 class Arc : public Drawable {
@@ -295,13 +1189,23 @@ function arc(ctx, x, y, r, sa, ea, fill) {
 }
 )");
 	}
-	virtual void draw(std::ostream &os) const override {
-		os << "arc(ctx, " << x.to_string() << ", "
-			<< y.to_string() << ", "
-			<< r.to_string() << ", "
-			<< sa.to_string() << ", "
-			<< ea.to_string() << ", "
-			<< fill.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "arc(ctx, " << x << ", "
+			<< y << ", "
+			<< r << ", "
+			<< sa << ", "
+			<< ea << ", "
+			<< fill << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::ARC);
+		return enc.value(x) && enc.value(y) && enc.value(r) && enc.value(sa) && enc.value(ea) && enc.value(fill);
+	}
+	virtual BoundingBox bounds() const override {
+		if (!x.is_literal() || !y.is_literal() || !r.is_literal())
+			return BoundingBox();
+		const auto r_abs = std::abs(r.get_number());
+		return BoundingBox(x.get_number() - r_abs, y.get_number() - r_abs, x.get_number() + r_abs, y.get_number() + r_abs);
 	}
 };
 
@@ -325,10 +1229,19 @@ function rect(ctx, x, y, w, h, fill) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "rect(ctx, " << x.to_string() << ", " << y.to_string() << ", "
-			<< w.to_string() << ", " << h.to_string() << ", "
-			<< fill.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "rect(ctx, " << x << ", " << y << ", "
+			<< w << ", " << h << ", "
+			<< fill << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::RECT);
+		return enc.value(x) && enc.value(y) && enc.value(w) && enc.value(h) && enc.value(fill);
+	}
+	virtual BoundingBox bounds() const override {
+		if (!x.is_literal() || !y.is_literal() || !w.is_literal() || !h.is_literal())
+			return BoundingBox();
+		return BoundingBox(x.get_number(), y.get_number(), x.get_number() + w.get_number(), y.get_number() + h.get_number());
 	}
 };
 
@@ -355,7 +1268,7 @@ function line(ctx, x1, y1, x2, y2) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
+	virtual void draw(OutputSink& os) const override {
 		if(points.size() == 2) {
 			os << "line(ctx, " << static_cast<int>(points[0].x) << ", " << static_cast<int>(points[0].y)
 				<< ", " << static_cast<int>(points[1].x) << ", " << static_cast<int>(points[1].y) << ");\n";
@@ -371,22 +1284,151 @@ function line(ctx, x1, y1, x2, y2) {
 			os << (fill ? "ctx.fill();\n" : "ctx.stroke();\n");
 		}
 	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		if(points.size() == 2) {
+			enc.op(FrameEncoder::LINE);
+		}
+		else {
+			enc.op(FrameEncoder::PATH);
+			enc.number(static_cast<CoordType>(points.size()));
+			enc.number(close_path ? 1 : 0);
+			enc.number(fill ? 1 : 0);
+		}
+		for(const auto& p : points) {
+			enc.number(static_cast<int>(p.x));
+			enc.number(static_cast<int>(p.y));
+		}
+		return true;
+	}
+	bool is_filled() const { return fill; }
+	/// Appends the point count, negative if the path is closed, and the points as drawn
+	void append_path(std::vector<CoordType>& path) const {
+		const auto n = static_cast<CoordType>(points.size());
+		path.push_back(close_path ? -n : n);
+		for(const auto& p : points) {
+			path.push_back(static_cast<int>(p.x));
+			path.push_back(static_cast<int>(p.y));
+		}
+	}
+	virtual BoundingBox bounds() const override {
+		BoundingBox box;
+		for(const auto& p : points) {
+			box.add(Vec2(static_cast<int>(p.x), static_cast<int>(p.y)));
+		}
+		return box;
+	}
+};
+
+/// Path through many points, stored as float32 and written as one base64 string
+class Polyline : public Drawable {
+	std::vector<float> xy;
+	bool fill;
+	bool close_path;
+	BoundingBox box;
+public:
+	/// xy holds the interleaved x and y coordinates of the points
+	explicit Polyline(std::vector<float>&& xy, bool fill, bool close_path, bool decimate)
+		: xy{std::move(xy)}, fill{fill}, close_path{close_path} {
+		if(this->xy.size() % 2 != 0)
+			throw std::logic_error("Polyline coordinates must come in x, y pairs");
+		if(this->xy.size() < 4)
+			throw std::logic_error("Need at least 2 points for polyline");
+		if(decimate)
+			decimate_to_pixels(this->xy);
+		for(size_t i = 0; i < this->xy.size(); i += 2) {
+			box.add(Vec2(this->xy[i], this->xy[i + 1]));
+		}
+	}
+
+	/// Reduce each run of points within one pixel column to its first, lowest, highest and last point,
+	/// which draws the same envelope at one unit per pixel
+	static void decimate_to_pixels(std::vector<float>& xy) {
+		size_t out = 0;
+		for(size_t begin = 0; begin < xy.size();) {
+			const auto column = std::floor(xy[begin]);
+			auto end = begin + 2;
+			auto min_i = begin, max_i = begin;
+			while(end < xy.size() && std::floor(xy[end]) == column) {
+				if(xy[end + 1] < xy[min_i + 1])
+					min_i = end;
+				if(xy[end + 1] > xy[max_i + 1])
+					max_i = end;
+				end += 2;
+			}
+			const size_t keep[4] = { begin, std::min(min_i, max_i), std::max(min_i, max_i), end - 2 };
+			for(size_t k = 0; k < 4; ++k) {
+				if(k > 0 && keep[k] == keep[k - 1])
+					continue;
+				xy[out++] = xy[keep[k]];
+				xy[out++] = xy[keep[k] + 1];
+			}
+			begin = end;
+		}
+		xy.resize(out);
+	}
+
+	size_t get_num_points() const { return xy.size() / 2; }
+
+	virtual void define(DefinitionsStream &ds) const override {
+		Base64Decoder::define(ds);
+		ds.write_if_undefined(typeid(Polyline).hash_code(), R"(
+function polyline(ctx, data, fill, close) {
+	const v = unpack_float32(data);
+	ctx.beginPath();
+	ctx.moveTo(v[0], v[1]);
+	for(let i = 2; i < v.length; i += 2)
+		ctx.lineTo(v[i], v[i+1]);
+	if(close)
+		ctx.closePath();
+	if(fill)
+		ctx.fill();
+	else
+		ctx.stroke();
+}
+)");
+	}
+	virtual void draw(OutputSink& os) const override {
+		os << "polyline(ctx, \"" << base64_encode_floats(xy) << "\", "
+			<< (fill ? "true" : "false") << ", " << (close_path ? "true" : "false") << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::POLYLINE);
+		enc.reference("\"" + base64_encode_floats(xy) + "\"");
+		enc.number(fill ? 1 : 0);
+		enc.number(close_path ? 1 : 0);
+		return true;
+	}
+	virtual BoundingBox bounds() const override { return box; }
 };
 
 class Font : public Drawable {
 	std::string font;
 public:
 	explicit Font(const std::string& font) : font{font} {}
-	virtual void draw(std::ostream& os) const override
+	virtual void draw(OutputSink& os) const override
 		{os << "ctx.font = \"" << font << "\";\n";}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::FONT);
+		enc.string(font);
+		return true;
+	}
+	/// Changes context state only
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class FillStyle : public Drawable {
 	std::string style;
 public:
 	explicit FillStyle(const std::string& style) : style{style} {}
-	virtual void draw(std::ostream& os) const override
+	virtual void draw(OutputSink& os) const override
 		{os << "ctx.fillStyle = \"" << style << "\";\n";}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::FILL_STYLE);
+		enc.string(style);
+		return true;
+	}
+	/// Changes context state only
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class FillStyleLinearGradient : public Drawable {
@@ -398,41 +1440,62 @@ public:
 		const std::string& color1, const std::string& color2)
 		: x0{ x0 }, y0{ y0 }, x1{ x1 }, y1{ y1 }, color1{ color1 }, color2{ color2 }
 	{}
-	virtual void draw(std::ostream& os) const override
+	virtual void draw(OutputSink& os) const override
 	{
 		os << "var grd = ctx.createLinearGradient("
-			<< x0.to_string() << ", "
-			<< y0.to_string() << ", "
-			<< x1.to_string() << ", "
-			<< y1.to_string() << ");\n";
+			<< x0 << ", "
+			<< y0 << ", "
+			<< x1 << ", "
+			<< y1 << ");\n";
 		os << "grd.addColorStop(0, \"" << color1 << "\");\n";
 		os << "grd.addColorStop(1, \"" << color2 << "\");\n";
 		os << "ctx.fillStyle = grd;\n";
 	}
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class StrokeStyle : public Drawable {
 	std::string style;
 public:
 	explicit StrokeStyle(const std::string& style) : style{style} {}
-	virtual void draw(std::ostream& os) const override
+	virtual void draw(OutputSink& os) const override
 		{os << "ctx.strokeStyle = \"" << style << "\";\n";}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::STROKE_STYLE);
+		enc.string(style);
+		return true;
+	}
+	/// Changes context state only
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class LineCap : public Drawable {
 	std::string style;
 public:
 	explicit LineCap(const std::string& style) : style{style} {}
-	virtual void draw(std::ostream& os) const override
+	virtual void draw(OutputSink& os) const override
 		{os << "ctx.lineCap = \"" << style << "\";\n";}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::LINE_CAP);
+		enc.string(style);
+		return true;
+	}
+	/// Changes context state only
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class LineWidth : public Drawable {
 	CoordExpressionValue width;
 public:
 	explicit LineWidth(const CoordExpressionValue& width) : width{width} {}
-	virtual void draw(std::ostream& os) const override
-		{os << "ctx.lineWidth = " << width.to_string() << ";\n";}
+	const CoordExpressionValue& get_width() const { return width; }
+	virtual void draw(OutputSink& os) const override
+		{os << "ctx.lineWidth = " << width << ";\n";}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::LINE_WIDTH);
+		return enc.value(width);
+	}
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class Text : public Drawable {
@@ -453,9 +1516,16 @@ function text(ctx, x, y, txt, fill) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "text(ctx, " << x.to_string() << ", " << y.to_string()
-			<< ", `" << txt << "`, " << fill.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "text(ctx, " << x << ", " << y
+			<< ", " << js_string(txt) << ", " << fill << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::TEXT);
+		if (!enc.value(x) || !enc.value(y))
+			return false;
+		enc.string(txt);
+		return enc.value(fill);
 	}
 };
 
@@ -464,18 +1534,40 @@ class Scale : public Drawable {
 public:
 	explicit Scale(const CoordExpressionValue& x, const CoordExpressionValue& y)
 		: x{ x }, y{ y } {}
-	virtual void draw(std::ostream& os) const override {
-		os << "ctx.scale(" << x.to_string() << ", " << y.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "ctx.scale(" << x << ", " << y << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::SCALE);
+		return enc.value(x) && enc.value(y);
+	}
+	virtual bool transform(Transform2D& t) const override {
+		if (!x.is_literal() || !y.is_literal())
+			return false;
+		t.scale(x.get_number(), y.get_number());
+		return true;
 	}
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class Rotate : public Drawable {
 	CoordExpressionValue rot;
 public:
 	explicit Rotate(const CoordExpressionValue& rot) : rot{ rot } {}
-	virtual void draw(std::ostream& os) const override {
-		os << "ctx.rotate(" << rot.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "ctx.rotate(" << rot << ");\n";
 	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::ROTATE);
+		return enc.value(rot);
+	}
+	virtual bool transform(Transform2D& t) const override {
+		if (!rot.is_literal())
+			return false;
+		t.rotate(rot.get_number());
+		return true;
+	}
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class Translate : public Drawable {
@@ -483,18 +1575,115 @@ class Translate : public Drawable {
 public:
 	explicit Translate(const CoordExpressionValue& x, const CoordExpressionValue& y)
 		: x{ x }, y{ y } {}
-	virtual void draw(std::ostream& os) const override {
-		os << "ctx.translate(" << x.to_string() << ", " << y.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "ctx.translate(" << x << ", " << y << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::TRANSLATE);
+		return enc.value(x) && enc.value(y);
 	}
+	virtual bool transform(Transform2D& t) const override {
+		if (!x.is_literal() || !y.is_literal())
+			return false;
+		t.translate(x.get_number(), y.get_number());
+		return true;
+	}
+	virtual BoundingBox bounds() const override { return BoundingBox::empty(); }
 };
 
 class DrawMacro : public Drawable {
 	std::string name;
 public:
 	explicit DrawMacro(const std::string& name) : name{name} {}
-	virtual void draw(std::ostream& os) const override {
+	virtual void draw(OutputSink& os) const override {
 		os << "macro_" << name << "(ctx);\n";
 	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::CALL_MACRO);
+		enc.reference("macro_" + name);
+		return true;
+	}
+	/// Macros may leave any transform behind
+	virtual bool transform(Transform2D&) const override { return false; }
+	const std::string& get_name() const { return name; }
+};
+
+/// Positions, scales and rotations of macro instances, one array per attribute
+class InstanceBuffer {
+	std::vector<float> x, y, scale, rotation;
+public:
+	InstanceBuffer& add(CoordType x, CoordType y, CoordType scale = 1, CoordType rotation = 0) {
+		this->x.push_back(static_cast<float>(x));
+		this->y.push_back(static_cast<float>(y));
+		this->scale.push_back(static_cast<float>(scale));
+		this->rotation.push_back(static_cast<float>(rotation));
+		return *this;
+	}
+	void reserve(size_t n) {
+		x.reserve(n);
+		y.reserve(n);
+		scale.reserve(n);
+		rotation.reserve(n);
+	}
+	size_t size() const { return x.size(); }
+	bool empty() const { return x.empty(); }
+	void clear() {
+		x.clear();
+		y.clear();
+		scale.clear();
+		rotation.clear();
+	}
+
+	/// All x, then all y, scale and rotation values
+	std::vector<float> pack() const {
+		std::vector<float> packed;
+		packed.reserve(4 * size());
+		packed.insert(packed.end(), x.begin(), x.end());
+		packed.insert(packed.end(), y.begin(), y.end());
+		packed.insert(packed.end(), scale.begin(), scale.end());
+		packed.insert(packed.end(), rotation.begin(), rotation.end());
+		return packed;
+	}
+};
+
+/// Draws a macro once per instance, translated, rotated and scaled, from one JS loop
+class DrawMacroInstances : public Drawable {
+	std::string name;
+	InstanceBuffer instances;
+public:
+	explicit DrawMacroInstances(const std::string& name, InstanceBuffer&& instances)
+		: name{name}, instances{std::move(instances)} {}
+	const std::string& get_name() const { return name; }
+	virtual void define(DefinitionsStream& ds) const override {
+		Base64Decoder::define(ds);
+		ds.write_if_undefined(typeid(DrawMacroInstances).hash_code(), R"(
+function macro_instances(ctx, macro, data) {
+	const v = unpack_float32(data);
+	const n = v.length / 4;
+	for(let i = 0; i < n; ++i) {
+		ctx.save();
+		ctx.translate(v[i], v[n+i]);
+		ctx.rotate(v[3*n+i]);
+		ctx.scale(v[2*n+i], v[2*n+i]);
+		macro(ctx);
+		ctx.restore();
+	}
+}
+)");
+	}
+	virtual void draw(OutputSink& os) const override {
+		if (instances.empty())
+			return;
+		os << "macro_instances(ctx, macro_" << name << ", \"" << base64_encode_floats(instances.pack()) << "\");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		if (instances.empty())
+			return true;
+		enc.op(FrameEncoder::MACRO_INSTANCES);
+		enc.reference("macro_" + name);
+		enc.reference("\"" + base64_encode_floats(instances.pack()) + "\"");
+		return true;
+	}
 };
 
 class DrawImage : public Drawable {
@@ -509,134 +1698,518 @@ public:
 			: surface{surface},
 			sx{sx}, sy{sy}, sWidth{sWidth}, sHeight{sHeight}, dx{dx}, dy{dy}, dWidth{dWidth}, dHeight{dHeight}
 			{}
-	virtual void draw(std::ostream& os) const override {
+	virtual void draw(OutputSink& os) const override {
 		os << "ctx.drawImage(surfaces[" << surface << "],"
-			<< sx.to_string() << ","
-			<< sy.to_string() << ","
-			<< sWidth.to_string() << ","
-			<< sHeight.to_string() << ","
-			<< dx.to_string() << ","
-			<< dy.to_string() << ","
-			<< dWidth.to_string() << ","
-			<< dHeight.to_string() << ");\n";
+			<< sx << ","
+			<< sy << ","
+			<< sWidth << ","
+			<< sHeight << ","
+			<< dx << ","
+			<< dy << ","
+			<< dWidth << ","
+			<< dHeight << ");\n";
+	}
+	virtual bool encode(FrameEncoder& enc) const override {
+		enc.op(FrameEncoder::DRAW_IMAGE);
+		enc.number(surface);
+		return enc.value(sx) && enc.value(sy) && enc.value(sWidth) && enc.value(sHeight)
+			&& enc.value(dx) && enc.value(dy) && enc.value(dWidth) && enc.value(dHeight);
+	}
+	virtual BoundingBox bounds() const override {
+		if (!dx.is_literal() || !dy.is_literal() || !dWidth.is_literal() || !dHeight.is_literal())
+			return BoundingBox();
+		return BoundingBox(dx.get_number(), dy.get_number(),
+			dx.get_number() + dWidth.get_number(), dy.get_number() + dHeight.get_number());
+	}
+};
+
+/// How HtmlAnim serializes frames
+struct WriteOptions {
+	/// Encode frames without expressions as opcode/float32 streams replayed by packed_frame()
+	bool compact_frames = false;
+	/// Threads serializing the frames of a layer, the output is the same for any number
+	size_t num_threads = 1;
+	/// Write identical frames once and reference them by index, streaming only merges consecutive repeats
+	bool dedupe_frames = false;
+	/// Write frames that only append drawables to the previous frame as deltas drawn without clearing
+	bool delta_frames = false;
+	/// Drop drawables whose static bounds lie outside the viewport
+	bool cull_offscreen = false;
+	/// Set by HtmlAnim for culling, the margin covers the widest stroke
+	BoundingBox viewport;
+	CoordType cull_margin = 0;
+	/// Draw runs of consecutive stroked lines as one path
+	bool batch_lines = false;
+	/// Write animated frames as keyframes with natively computed values, in layers where that
+	/// multiplies the number of written drawables at most by bake_size_factor
+	bool bake_expressions = false;
+	CoordType bake_size_factor = 8;
+	/// Set by HtmlAnim, macros that draw into surfaces
+	std::unordered_set<std::string> surface_macros;
+	/// Set by HtmlAnim for each write, copies share it
+	std::shared_ptr<UsedHelpers> used_helpers = std::make_shared<UsedHelpers>();
+};
+
+/// State of the write-time passes over a frame: culling and line batching
+class WriteContext {
+	struct State {
+		Transform2D transform;
+		bool known = true;
+	};
+	bool cull;
+	BoundingBox viewport;
+	CoordType margin;
+	State state;
+	std::vector<State> saved;
+
+public:
+	bool batch_lines;
+	/// Reused buffer for batched line paths
+	std::vector<CoordType> path;
+	UsedHelpers* used_helpers;
+
+	/// The culling margin covers the stroke width, which applies in the current coordinate system
+	explicit WriteContext(const WriteOptions& options, bool cull)
+		: cull{ cull }, viewport{ options.viewport }, margin{ options.cull_margin }, batch_lines{ options.batch_lines },
+		used_helpers{ options.used_helpers.get() } {}
+
+	bool is_active() const { return cull || batch_lines; }
+
+	void save() { saved.push_back(state); }
+	void restore() {
+		state = saved.back();
+		saved.pop_back();
+	}
+
+	/// Tracks the static canvas transform to drop drawables outside the viewport
+	bool is_visible(const Drawable& dwbl) const {
+		if (!cull || !state.known)
+			return true;
+		auto box = dwbl.bounds();
+		if (!box.known || box.is_empty())
+			return true;
+		box.expand(margin);
+		return state.transform.apply(box).intersects(viewport);
+	}
+
+	void apply(const Drawable& dwbl) {
+		if (cull && state.known)
+			state.known = dwbl.transform(state.transform);
+	}
+};
+
+using DrawablePtr = std::unique_ptr<Drawable, ArenaDeleter>;
+using ExpressionPtr = std::unique_ptr<Expression, ArenaDeleter>;
+using DrawableVector = std::vector<DrawablePtr>;
+using ExpressionVector = std::vector<ExpressionPtr>;
+
+class Frame : public Drawable {
+	Arena* arena;
+	DrawableVector dwbl_vec;
+	ExpressionVector expr_vec;
+	Frame* parent = nullptr;
+	SizeType num_expression_ids = 0;
+	SizeType fps = FPS;
+
+	template<typename T, typename... Args>
+	std::unique_ptr<T, ArenaDeleter> make(Args&&... args) {
+		if (arena)
+			return std::unique_ptr<T, ArenaDeleter>(arena->create<T>(std::forward<Args>(args)...), ArenaDeleter(true));
+		return std::unique_ptr<T, ArenaDeleter>(new T(std::forward<Args>(args)...));
+	}
+
+	/// Expression variables live until their top-level frame is done, so nested frames number them together
+	SizeType next_expression_id() {
+		return parent ? parent->next_expression_id() : num_expression_ids++;
+	}
+
+	Frame& add_frame(std::unique_ptr<Frame, ArenaDeleter>&& frm) {
+		frm->parent = this;
+		add_drawable(std::move(frm));
+		return static_cast<Frame&>(*dwbl_vec.back());
+	}
+
+public:
+	explicit Frame(Arena* arena = nullptr) : arena{ arena } {}
+
+	/// Playback rate the tweening expressions convert seconds with, nested frames use their top-level frame's
+	SizeType get_fps() const { return parent ? parent->get_fps() : fps; }
+	void set_fps(SizeType frames_per_sec) { fps = frames_per_sec; }
+
+	Frame& add_drawable(DrawablePtr&& dwbl) {
+		dwbl_vec.emplace_back(std::move(dwbl));
+		return *this;
+	}
+
+	const CoordExpressionValue& add_coord_expression(ExpressionPtr&& expr) {
+		expr_vec.emplace_back(std::move(expr));
+		return dynamic_cast<const CoordExpressionValue&>(expr_vec.back()->value());
+	}
+
+	const PointExpressionValue& add_point_expression(ExpressionPtr&& expr) {
+		expr_vec.emplace_back(std::move(expr));
+		return dynamic_cast<const PointExpressionValue&>(expr_vec.back()->value());
+	}
+
+	void clear() {dwbl_vec.clear();}
+
+	const DrawableVector& drawables() const { return dwbl_vec; }
+
+	/// True if this frame or a nested frame animates expressions
+	bool has_expressions() const {
+		if (!expr_vec.empty())
+			return true;
+		for (auto& dwbl : dwbl_vec) {
+			auto frm = dynamic_cast<const Frame*>(dwbl.get());
+			if (frm && frm->has_expressions())
+				return true;
+		}
+		return false;
+	}
+
+	void define(DefinitionsStream &ds) const override {
+		for(auto& dwbl : dwbl_vec) {
+			dwbl->define(ds);
+		}
+	}
+
+	/// Surfaces may be redrawn by other layers, so frames copying them are never still
+	bool add_still_ticks(SizeType& ticks) const {
+		for (auto& expr : expr_vec) {
+			auto wait = dynamic_cast<const WaitExpression*>(expr.get());
+			if (!wait)
+				return false;
+			ticks = std::max(ticks, wait->get_frames());
+		}
+		for (auto& dwbl : dwbl_vec) {
+			if (auto frm = dynamic_cast<const Frame*>(dwbl.get())) {
+				if (!frm->add_still_ticks(ticks))
+					return false;
+			}
+			else if (dynamic_cast<const DrawImage*>(dwbl.get())) {
+				return false;
+			}
+		}
+		return true;
 	}
-};
-
-using DrawableVector = std::vector<std::unique_ptr<Drawable>>;
-using ExpressionVector = std::vector<std::unique_ptr<Expression>>;
-
-class Frame : public Drawable {
-	DrawableVector dwbl_vec;
-	ExpressionVector expr_vec;
-public:
-	Frame() {}
 
-	Frame& add_drawable(std::unique_ptr<Drawable>&& dwbl) {
-		dwbl_vec.emplace_back(std::move(dwbl));
-		return *this;
+	/// Canvas extent of everything this frame draws, grown by margin, unknown unless all of it is static
+	BoundingBox content_bounds(CoordType margin) const {
+		Transform2D t;
+		auto box = BoundingBox::empty();
+		if (!Frame::add_content_bounds(t, margin, box))
+			return BoundingBox();
+		return box;
 	}
 
-	const CoordExpressionValue& add_coord_expression(std::unique_ptr<Expression>&& expr) {
-		expr_vec.emplace_back(std::move(expr));
-		return dynamic_cast<const CoordExpressionValue&>(expr_vec.back()->value());
+	virtual bool add_content_bounds(Transform2D& t, CoordType margin, BoundingBox& box) const {
+		for (auto& dwbl : dwbl_vec) {
+			if (auto frm = dynamic_cast<const Frame*>(dwbl.get())) {
+				if (!frm->add_content_bounds(t, margin, box))
+					return false;
+				continue;
+			}
+			if (!dwbl->transform(t))
+				return false;
+			auto dwbl_box = dwbl->bounds();
+			if (!dwbl_box.known)
+				return false;
+			if (dwbl_box.is_empty())
+				continue;
+			dwbl_box.expand(margin);
+			box.add(t.apply(dwbl_box));
+		}
+		return true;
 	}
 
-	const PointExpressionValue& add_point_expression(std::unique_ptr<Expression>&& expr) {
-		expr_vec.emplace_back(std::move(expr));
-		return dynamic_cast<const PointExpressionValue&>(expr_vec.back()->value());
+	/// Calls f for every drawable of this frame and its nested frames
+	template<typename F>
+	void visit(F&& f) const {
+		for (auto& dwbl : dwbl_vec) {
+			f(*dwbl);
+			if (auto frm = dynamic_cast<const Frame*>(dwbl.get()))
+				frm->visit(f);
+		}
 	}
 
-	void clear() {dwbl_vec.clear();}
+	bool encode(FrameEncoder& enc) const override { return encode_with(enc, nullptr); }
+	void draw(OutputSink& os) const override { draw_with(os, nullptr); }
 
-	void define(DefinitionsStream &ds) const override {
-		for(auto& dwbl : dwbl_vec) {
-			dwbl->define(ds);
-		}
+	/// Extra ticks this frame is held while drawing the same picture, 0 unless its only expressions are waits
+	SizeType still_ticks() const {
+		SizeType ticks = 0;
+		return add_still_ticks(ticks) ? ticks : 0;
+	}
+
+	/// Without a context all drawables are written. Baked frames need no expression code
+	virtual bool encode_with(FrameEncoder& enc, WriteContext* context) const {
+		if (!expr_vec.empty() && !ExpressionValue::baked_values())
+			return false;
+		return encode_drawables(enc, 0, context);
 	}
 
-	void draw(std::ostream& os) const override {
+	virtual void draw_with(OutputSink& os, WriteContext* context) const {
+		if (ExpressionValue::baked_values()) {
+			draw_drawables(os, 0, context);
+			return;
+		}
 		for(auto& expr : expr_vec) {
 			expr->init(os);
 		}
-		for(auto& dwbl : dwbl_vec) {
-			dwbl->draw(os);
+		draw_drawables(os, 0, context);
+		// One test holds the frame for the longest of the built-in expressions, other expressions may still extend it
+		if (!parent) {
+			const auto hold = hold_ticks();
+			if (hold > 0)
+				os << "layer.repeat_current_frame = layer.tick < " << hold << ";\n";
 		}
 		for (auto& expr : expr_vec) {
 			expr->exit(os);
 		}
 	}
 
+	/// Extra ticks the expressions of this frame and its nested frames hold it for
+	SizeType hold_ticks() const {
+		SizeType ticks = 0;
+		for (auto& expr : expr_vec)
+			ticks = std::max(ticks, expr->hold_ticks());
+		for (auto& dwbl : dwbl_vec) {
+			if (auto frm = dynamic_cast<const Frame*>(dwbl.get()))
+				ticks = std::max(ticks, frm->hold_ticks());
+		}
+		return ticks;
+	}
+
+	/// Native values of all expression variables at tick in JS order, false if some have none
+	bool evaluate_expressions(SizeType tick, ExpressionValue::Bindings& values) const {
+		for (auto& expr : expr_vec) {
+			if (!expr->evaluate(tick, values))
+				return false;
+		}
+		for (auto& dwbl : dwbl_vec) {
+			auto frm = dynamic_cast<const Frame*>(dwbl.get());
+			if (frm && !frm->evaluate_expressions(tick, values))
+				return false;
+		}
+		return true;
+	}
+
+	/// Animated frames whose expressions are all known natively can be written as one keyframe per tick.
+	/// Frames held only by waits are already drawn once
+	bool can_bake() const {
+		ExpressionValue::Bindings values;
+		return hold_ticks() > 0 && still_ticks() == 0 && evaluate_expressions(0, values);
+	}
+
+	/// Encodes the drawables from index first on
+	bool encode_drawables(FrameEncoder& enc, size_t first, WriteContext* context) const {
+		for (auto i = first; i < dwbl_vec.size();) {
+			const auto end = context ? batch_lines(i, *context) : i;
+			if (end > i) {
+				if (!context->path.empty()) {
+					context->used_helpers->stroke_paths = true;
+					enc.op(FrameEncoder::STROKE_PATHS);
+					enc.number(static_cast<CoordType>(context->path.size()));
+					for (auto v : context->path) {
+						enc.number(v);
+					}
+				}
+				i = end;
+				continue;
+			}
+			if (!encode_child(enc, *dwbl_vec[i], context))
+				return false;
+			++i;
+		}
+		return true;
+	}
+
+	/// Writes the drawables from index first on
+	void draw_drawables(OutputSink& os, size_t first, WriteContext* context) const {
+		for (auto i = first; i < dwbl_vec.size();) {
+			const auto end = context ? batch_lines(i, *context) : i;
+			if (end > i) {
+				if (!context->path.empty()) {
+					context->used_helpers->stroke_paths = true;
+					os << "stroke_paths(ctx, [";
+					for (size_t v_i = 0; v_i < context->path.size(); ++v_i) {
+						if (v_i > 0)
+							os << ",";
+						os << context->path[v_i];
+					}
+					os << "]);\n";
+				}
+				i = end;
+				continue;
+			}
+			draw_child(os, *dwbl_vec[i], context);
+			++i;
+		}
+	}
+
+	/// Collects the visible lines of a run of at least two stroked lines starting at index i
+	/// into context.path and returns the index after the run, or i if there is no such run
+	size_t batch_lines(size_t i, WriteContext& context) const {
+		if (!context.batch_lines)
+			return i;
+		auto end = i;
+		while (end < dwbl_vec.size()) {
+			const auto line = dynamic_cast<const Line*>(dwbl_vec[end].get());
+			if (!line || line->is_filled())
+				break;
+			++end;
+		}
+		if (end - i < 2)
+			return i;
+		context.path.clear();
+		for (auto j = i; j < end; ++j) {
+			const auto& line = static_cast<const Line&>(*dwbl_vec[j]);
+			if (context.is_visible(line))
+				line.append_path(context.path);
+		}
+		return end;
+	}
+
+	/// JS helper stroking batched lines, each as its point count (negative if closed) followed by its points
+	static void define_stroke_paths(DefinitionsStream& ds) {
+		ds.write_if_undefined(typeid(WriteContext).hash_code(), R"(
+function stroke_paths(ctx, d) {
+	ctx.beginPath();
+	for(let i = 0; i < d.length;) {
+		const n = Math.abs(d[i]);
+		ctx.moveTo(d[i+1], d[i+2]);
+		for(let p = 1; p < n; ++p)
+			ctx.lineTo(d[i+1+2*p], d[i+2+2*p]);
+		if(d[i] < 0)
+			ctx.closePath();
+		i += 1 + 2 * n;
+	}
+	ctx.stroke();
+}
+)");
+	}
+
+	static bool encode_child(FrameEncoder& enc, const Drawable& dwbl, WriteContext* context) {
+		if (!context)
+			return dwbl.encode(enc);
+		if (auto frm = dynamic_cast<const Frame*>(&dwbl))
+			return frm->encode_with(enc, context);
+		const bool visible = context->is_visible(dwbl);
+		context->apply(dwbl);
+		return !visible || dwbl.encode(enc);
+	}
+
+	static void draw_child(OutputSink& os, const Drawable& dwbl, WriteContext* context) {
+		if (!context) {
+			dwbl.draw(os);
+			return;
+		}
+		if (auto frm = dynamic_cast<const Frame*>(&dwbl)) {
+			frm->draw_with(os, context);
+			return;
+		}
+		if (context->is_visible(dwbl))
+			dwbl.draw(os);
+		context->apply(dwbl);
+	}
+
 	// DRAWABLE WRAPPERS
 	Frame& arc(const CoordExpressionValue& x, const CoordExpressionValue& y, const CoordExpressionValue& r,
 		const BoolExpressionValue& fill = false, const CoordExpressionValue& sa = 0.0, const CoordExpressionValue& ea = 2 * PI)
 	{
-		return add_drawable(std::make_unique<Arc>(x, y, r, sa, ea, fill));
+		return add_drawable(make<Arc>(x, y, r, sa, ea, fill));
 	}
 	Frame& arc(const PointExpressionValue& p, const CoordExpressionValue& r,
 		const BoolExpressionValue& fill = false, const CoordExpressionValue& sa = 0.0, const CoordExpressionValue & ea = 2 * PI)
 	{
-		return add_drawable(std::make_unique<Arc>(p.to_string(), p.to_string_2(), r, sa, ea, fill));
+		return add_drawable(make<Arc>(p.to_string(), p.to_string_2(), r, sa, ea, fill));
 	}
 	Frame& draw_macro(const std::string& name) {
-		return add_drawable(std::make_unique<DrawMacro>(name));
+		return add_drawable(make<DrawMacro>(name));
+	}
+	/// Draw macro name around each instance position, scaled and rotated per instance
+	Frame& draw_macro_instances(const std::string& name, InstanceBuffer&& instances) {
+		return add_drawable(make<DrawMacroInstances>(name, std::move(instances)));
+	}
+	Frame& draw_macro_instances(const std::string& name, const InstanceBuffer& instances) {
+		return draw_macro_instances(name, InstanceBuffer(instances));
 	}
 	Frame& fill_style(const std::string& style)
 	{
-		return add_drawable(std::make_unique<FillStyle>(style));
+		return add_drawable(make<FillStyle>(style));
 	}
 	Frame& fill_style_linear_gradient(const CoordExpressionValue& x0, const CoordExpressionValue& y0,
 		const CoordExpressionValue& x1, const CoordExpressionValue& y1,
 		const std::string& color1, const std::string& color2)
 	{
-		return add_drawable(std::make_unique<FillStyleLinearGradient>(x0, y0, x1, y1, color1, color2));
+		return add_drawable(make<FillStyleLinearGradient>(x0, y0, x1, y1, color1, color2));
 	}
 	Frame& font(const std::string& font)
 	{
-		return add_drawable(std::make_unique<Font>(font));
+		return add_drawable(make<Font>(font));
 	}
 	Frame& line(CoordType x1, CoordType y1, CoordType x2, CoordType y2)
 	{
-		return add_drawable(std::make_unique<Line>(x1, y1, x2, y2));
+		return add_drawable(make<Line>(x1, y1, x2, y2));
 	}
 	Frame& line(const Vec2Vector& points, bool fill = false, bool close_path = false)
 	{
-		return add_drawable(std::make_unique<Line>(points, fill, close_path));
+		return add_drawable(make<Line>(points, fill, close_path));
+	}
+	/// Path through points given as interleaved x, y coordinates, decimate merges points sharing a pixel column
+	Frame& polyline(std::vector<float>&& xy, bool fill = false, bool close_path = false, bool decimate = false)
+	{
+		return add_drawable(make<Polyline>(std::move(xy), fill, close_path, decimate));
+	}
+	Frame& polyline(const float* xy, size_t num_points, bool fill = false, bool close_path = false, bool decimate = false)
+	{
+		return polyline(std::vector<float>(xy, xy + 2 * num_points), fill, close_path, decimate);
+	}
+	Frame& polyline(const Vec2Vector& points, bool fill = false, bool close_path = false, bool decimate = false)
+	{
+		std::vector<float> xy;
+		xy.reserve(2 * points.size());
+		for (const auto& p : points) {
+			xy.push_back(static_cast<float>(p.x));
+			xy.push_back(static_cast<float>(p.y));
+		}
+		return polyline(std::move(xy), fill, close_path, decimate);
 	}
 	Frame& line_cap(const std::string& style)
 	{
-		return add_drawable(std::make_unique<LineCap>(style));
+		return add_drawable(make<LineCap>(style));
 	}
 	Frame& line_width(const CoordExpressionValue& width)
 	{
-		return add_drawable(std::make_unique<LineWidth>(width));
+		return add_drawable(make<LineWidth>(width));
 	}
 	Frame& rect(const CoordExpressionValue& x, const CoordExpressionValue& y, const CoordExpressionValue& w, const CoordExpressionValue& h, const BoolExpressionValue& fill = false)
 	{
-		return add_drawable(std::make_unique<Rect>(x, y, w, h, fill));
+		return add_drawable(make<Rect>(x, y, w, h, fill));
 	}
 	Frame& rotate(const CoordExpressionValue& rot)
 	{
-		return add_drawable(std::make_unique<Rotate>(rot));
+		return add_drawable(make<Rotate>(rot));
 	}
 	Frame& scale(const CoordExpressionValue& x, const CoordExpressionValue& y)
 	{
-		return add_drawable(std::make_unique<Scale>(x, y));
+		return add_drawable(make<Scale>(x, y));
 	}
 	Frame& stroke_style(const std::string& style)
 	{
-		return add_drawable(std::make_unique<StrokeStyle>(style));
+		return add_drawable(make<StrokeStyle>(style));
 	}
 	Frame& text(const CoordExpressionValue& x, const CoordExpressionValue& y, std::string txt, const BoolExpressionValue& fill = true)
 	{
-		return add_drawable(std::make_unique<Text>(x, y, txt.c_str(), fill));
+		return add_drawable(make<Text>(x, y, txt.c_str(), fill));
 	}
 	Frame& translate(const CoordExpressionValue& x, const CoordExpressionValue& y)
 	{
-		return add_drawable(std::make_unique<Translate>(x, y));
+		return add_drawable(make<Translate>(x, y));
 	}
 	Frame& wait(SizeType n_frames)
 	{
-		add_coord_expression(std::make_unique<LinearRangeExpression>(0, n_frames, n_frames));
+		add_coord_expression(make<WaitExpression>(n_frames, next_expression_id()));
 		return *this;
 	}
 	Frame& drawImage(SizeType surface, const CoordExpressionValue& sx, const CoordExpressionValue& sy,
@@ -644,133 +2217,704 @@ public:
 		const CoordExpressionValue& dx, const CoordExpressionValue& dy,
 		const CoordExpressionValue& dWidth, const CoordExpressionValue& dHeight)
 	{
-		return add_drawable(std::make_unique<DrawImage>(surface, sx, sy, sWidth, sHeight, dx, dy, dWidth, dHeight));
+		return add_drawable(make<DrawImage>(surface, sx, sy, sWidth, sHeight, dx, dy, dWidth, dHeight));
 	}
 
 	// EXPRESSION WRAPPERS
 	const PointExpressionValue& linear_point_range(const Vec2& start, const Vec2& stop, SizeType steps)
 	{
-		return add_point_expression(std::make_unique<LinearPointExpression>(start, stop, steps));
+		const auto id_1 = next_expression_id();
+		return add_point_expression(make<LinearPointExpression>(start, stop, steps, id_1, next_expression_id()));
 	}
 	const CoordExpressionValue& linear_range(CoordType start, CoordType stop, SizeType steps)
 	{
-		return add_coord_expression(std::make_unique<LinearRangeExpression>(start, stop, steps));
+		return add_coord_expression(make<LinearRangeExpression>(start, stop, steps, next_expression_id()));
 	}
 	const CoordExpressionValue& linear_transform(CoordType start, CoordType stop, SizeType steps, const std::string& transform)
 	{
-		return add_coord_expression(std::make_unique<LinearTransformExpression>(start, stop, steps, transform));
+		return add_coord_expression(make<LinearTransformExpression>(start, stop, steps, transform, next_expression_id()));
 	}
 	const PointExpressionValue& linear_transform_point(const Vec2& start, const Vec2& stop, SizeType steps,
 		const std::string& transform_x, const std::string& transform_y)
 	{
-		return add_point_expression(std::make_unique<LinearTransformPointExpression>(start, stop, steps,
-			transform_x, transform_y));
+		const auto id_1 = next_expression_id();
+		return add_point_expression(make<LinearTransformPointExpression>(start, stop, steps,
+			transform_x, transform_y, id_1, next_expression_id()));
+	}
+
+	/// Value of transform with its variable X going from start to stop over steps ticks
+	const CoordExpressionValue& linear_transform(CoordType start, CoordType stop, SizeType steps, const Formula& transform)
+	{
+		const auto hold_ticks = LinearRangeExpression::is_constant(start, stop, steps) ? 0 : steps;
+		return add_coord_expression(make<FormulaExpression>(
+			transform.substitute(LinearRangeExpression::closed_form(start, stop, steps)), hold_ticks, next_expression_id()));
+	}
+	/// Value of a formula of other expression values, e.g. 2 * sin(Formula(x))
+	const CoordExpressionValue& compute(const Formula& formula)
+	{
+		return add_coord_expression(make<FormulaExpression>(formula, 0, next_expression_id()));
 	}
 
 	// TWEENING EXPRESSIONS
+	/// Value of transform with its variable X going from 0 to 1 over duration_sec
+	const CoordExpressionValue& tween(const Formula& transform, CoordType duration_sec)
+	{
+		return linear_transform(0, 1, static_cast<SizeType>(duration_sec * get_fps()), transform);
+	}
 	const CoordExpressionValue& ease_in(CoordType begin, CoordType change, CoordType duration_sec, CoordType strength = 2)
 	{
-		const auto steps = static_cast<SizeType>(duration_sec * FPS);
-		const auto transform = std::to_string(change) + " * Math.pow(X, " + std::to_string(strength) + ") + " + std::to_string(begin);
-		return add_coord_expression(std::make_unique<LinearTransformExpression>(0, 1, steps, transform));
+		return tween(change * pow(Formula::variable(), strength) + begin, duration_sec);
 	}
 	const CoordExpressionValue& ease_out(CoordType begin, CoordType change, CoordType duration_sec, CoordType strength = 2)
 	{
-		const auto steps = static_cast<SizeType>(duration_sec * FPS);
-		const auto transform = std::to_string(change) + " * (1 - Math.pow(1 - X, " + std::to_string(strength) + ")) + " + std::to_string(begin);
-		return add_coord_expression(std::make_unique<LinearTransformExpression>(0, 1, steps, transform));
+		return tween(change * (1 - pow(1 - Formula::variable(), strength)) + begin, duration_sec);
 	}
 	const CoordExpressionValue& linear_tween(CoordType begin, CoordType change, CoordType duration_sec)
 	{
-		const auto steps = static_cast<SizeType>(duration_sec * FPS);
-		const auto transform = std::to_string(change) + " * X + " + std::to_string(begin);
-		return add_coord_expression(std::make_unique<LinearTransformExpression>(0, 1, steps, transform));
+		return tween(change * Formula::variable() + begin, duration_sec);
 	}
 
 	Frame& save();
-	Frame& define_macro(const std::string& name);
+	/// With cache_sprite a macro whose content is static is drawn as a bitmap, see DefineMacro
+	Frame& define_macro(const std::string& name, bool cache_sprite = false);
 	Frame& surface(SizeType i);
 };
 
 class Save : public Frame {
 public:
-	explicit Save() {}
-	virtual void draw(std::ostream& os) const override {
+	explicit Save(Arena* arena = nullptr) : Frame{ arena } {}
+	virtual bool add_content_bounds(Transform2D& t, CoordType margin, BoundingBox& box) const override {
+		Transform2D saved = t;
+		return Frame::add_content_bounds(saved, margin, box);
+	}
+	virtual void draw_with(OutputSink& os, WriteContext* context) const override {
 		os << "ctx.save();\n";
-		Frame::draw(os);
+		if (context)
+			context->save();
+		Frame::draw_with(os, context);
+		if (context)
+			context->restore();
 		os << "ctx.restore();\n";
 	}
+	virtual bool encode_with(FrameEncoder& enc, WriteContext* context) const override {
+		enc.op(FrameEncoder::SAVE);
+		if (context)
+			context->save();
+		const bool encoded = Frame::encode_with(enc, context);
+		if (context)
+			context->restore();
+		if (!encoded)
+			return false;
+		enc.op(FrameEncoder::RESTORE);
+		return true;
+	}
 };
 
 Frame& Frame::save() {
-	add_drawable(std::make_unique<Save>());
-	return static_cast<Frame&>(*dwbl_vec.back());
+	return add_frame(make<Save>(arena));
 }
 
 class Surface : public Frame {
 	SizeType surface_id;
 public:
-	explicit Surface(SizeType i) : surface_id{ i } {}
-	virtual void draw(std::ostream& os) const override {
+	explicit Surface(SizeType i, Arena* arena = nullptr) : Frame{ arena }, surface_id{ i } {}
+	/// Surfaces keep their own context state, so their drawables are never culled
+	virtual void draw_with(OutputSink& os, WriteContext*) const override {
 		os << 
 			"context_stack.push(ctx);\n" <<
 			"ctx = surfaces[" << surface_id << "].getContext('2d');\n";
-		Frame::draw(os);
+		Frame::draw_with(os, nullptr);
 		os << "ctx = context_stack.pop();\n";
 	}
+	virtual bool encode_with(FrameEncoder&, WriteContext*) const override { return false; }
+	virtual bool add_content_bounds(Transform2D&, CoordType, BoundingBox&) const override { return false; }
 };
 
 Frame& Frame::surface(SizeType i) {
-	add_drawable(std::make_unique<Surface>(i));
-	return static_cast<Frame&>(*dwbl_vec.back());
+	return add_frame(make<Surface>(i, arena));
 }
 
 class DefineMacro : public Frame {
 	std::string name;
+	bool cache_sprite;
+
+	/// Sprite rectangle in whole pixels around the content, false if the content is not static.
+	/// Images read surfaces that may change between calls, so they are never static.
+	/// The margin covers miter joins of the widest literal line, which reach 10 half widths.
+	bool sprite_bounds(BoundingBox& box) const {
+		CoordType max_line_width = 1;
+		bool static_content = true;
+		visit([&](const Drawable& dwbl) {
+			if (auto lw = dynamic_cast<const LineWidth*>(&dwbl)) {
+				if (lw->get_width().is_literal())
+					max_line_width = std::max(max_line_width, std::abs(lw->get_width().get_number()));
+				else
+					static_content = false;
+			}
+			else if (dynamic_cast<const DrawImage*>(&dwbl)) {
+				static_content = false;
+			}
+		});
+		if (!static_content)
+			return false;
+		box = content_bounds(max_line_width * 5 + 1);
+		if (!box.known || box.is_empty())
+			return false;
+		box = BoundingBox(std::floor(box.min.x), std::floor(box.min.y), std::ceil(box.max.x), std::ceil(box.max.y));
+		return true;
+	}
+
 public:
-	explicit DefineMacro(const std::string& name) : name{name} {}
+	/// A cached macro is rendered once into its own canvas, each call then copies that bitmap.
+	/// The sprite starts from the default context state, so it must set the styles it uses.
+	explicit DefineMacro(const std::string& name, Arena* arena = nullptr, bool cache_sprite = false)
+		: Frame{ arena }, name{name}, cache_sprite{cache_sprite} {}
 	void define(DefinitionsStream &ds) const override {
 		Frame::define(ds);
+		BoundingBox box;
+		if (cache_sprite && sprite_bounds(box)) {
+			ds.write_if_undefined(typeid(DefineMacro).hash_code(), R"(
+function render_sprite(draw, x, y, w, h) {
+	const cv = document.createElement('canvas');
+	cv.width = w;
+	cv.height = h;
+	const ctx = cv.getContext('2d');
+	ctx.translate(-x, -y);
+	draw(ctx);
+	return cv;
+}
+)");
+			auto& os = ds.stream();
+			os << "function macro_" << name << "(ctx) {\n"
+				<< "if(macro_" << name << ".sprite === undefined)\n"
+				<< "macro_" << name << ".sprite = render_sprite(function(ctx) {\n";
+			Frame::draw_with(os, nullptr);
+			os << "}, " << box.min.x << ", " << box.min.y << ", "
+				<< box.max.x - box.min.x << ", " << box.max.y - box.min.y << ");\n"
+				<< "ctx.drawImage(macro_" << name << ".sprite, " << box.min.x << ", " << box.min.y << ");\n"
+				<< "}\n";
+			return;
+		}
 		ds.stream() << "function macro_" << name << "(ctx) {\n";
-		Frame::draw(ds.stream());
+		Frame::draw_with(ds.stream(), nullptr);
 		ds.stream() << "}\n";
 	}
-	virtual void draw(std::ostream& os) const override {}
+	virtual void draw_with(OutputSink&, WriteContext*) const override {}
+	virtual bool encode_with(FrameEncoder&, WriteContext*) const override { return true; }
+	const std::string& get_name() const { return name; }
+	/// Defining a macro draws nothing
+	virtual bool add_content_bounds(Transform2D&, CoordType, BoundingBox&) const override { return true; }
 };
 
-Frame& Frame::define_macro(const std::string& name) {
-	add_drawable(std::make_unique<DefineMacro>(name));
-	return static_cast<Frame&>(*dwbl_vec.back());
+Frame& Frame::define_macro(const std::string& name, bool cache_sprite) {
+	return add_frame(make<DefineMacro>(name, arena, cache_sprite));
 }
 
 using FrameVector = std::vector<std::unique_ptr<Frame>>;
 
+/// Serialized drawables of the previous frame, compared against the next one to find delta frames
+struct DeltaFrameState {
+	/// The frame has no expressions and text holds its drawables
+	bool drawn = false;
+	/// Drawing the frame again would leave the context as it was, so later frames may skip it
+	bool can_prefix = false;
+	std::string text;
+	std::vector<size_t> ends;
+
+	void assign(const Frame& frm, WriteContext* context) {
+		drawn = !frm.has_expressions();
+		can_prefix = drawn;
+		text.clear();
+		ends.clear();
+		if (!drawn)
+			return;
+		OutputSink out;
+		for (auto& dwbl : frm.drawables()) {
+			Transform2D t;
+			if (!dwbl->transform(t) || !t.is_identity() || dynamic_cast<const Surface*>(dwbl.get()))
+				can_prefix = false;
+			Frame::draw_child(out, *dwbl, context);
+			ends.push_back(out.size());
+		}
+		text = out.take();
+	}
+
+	/// Number of leading drawables of next that repeat this whole frame, 0 if next is no delta
+	size_t delta_start(const DeltaFrameState& next) const {
+		if (!can_prefix || !next.drawn || ends.empty() || ends.size() >= next.ends.size())
+			return 0;
+		for (size_t i = 0; i < ends.size(); ++i) {
+			if (ends[i] != next.ends[i])
+				return 0;
+		}
+		if (std::memcmp(text.data(), next.text.data(), text.size()) != 0)
+			return 0;
+		return ends.size();
+	}
+};
+
 class Layer {
 private:
+	Arena arena;
 	FrameVector frame_vec;
 	size_t cur_frame;
+	SizeType fps;
 	bool no_clear = false;
+	bool is_static = false;
+
+	OutputSink* stream_os = nullptr;
+	DefinitionsStream* stream_ds = nullptr;
+	const WriteOptions* stream_options = nullptr;
+	size_t stream_index = 0;
+	size_t num_streamed = 0;
+	std::string last_streamed_text;
+	size_t last_streamed_index = 0;
+	bool stream_accumulates = false;
+	DeltaFrameState stream_delta_state;
+
+	/// A single frame without expressions looks the same on every tick unless it copies a surface another layer may change
+	bool renders_once() const {
+		if (is_static)
+			return true;
+		if (stream_os || num_streamed > 0 || frame_vec.size() != 1 || frame_vec[0]->has_expressions())
+			return false;
+		bool reads_surface = false;
+		frame_vec[0]->visit([&reads_surface](const Drawable& dwbl) {
+			if (dynamic_cast<const DrawImage*>(&dwbl))
+				reads_surface = true;
+		});
+		return !reads_surface;
+	}
+
+	/// Layers that keep what earlier ticks drew must draw every tick, the runtime skips no ticks for them
+	bool accumulates(const WriteOptions& options) const {
+		if (no_clear)
+			return true;
+		for (const auto& frm : frame_vec) {
+			if (draws_into_surface(*frm, options))
+				return true;
+		}
+		return false;
+	}
+
+	void write_properties(OutputSink& os, const WriteOptions& options) const {
+		os << "{frame_counter: 0,\nno_clear : " << (no_clear ? "true" : "false")
+			<< ",\nstatic_layer : " << (renders_once() ? "true" : "false")
+			<< ",\naccumulates : " << (accumulates(options) ? "true" : "false") << R"(,
+repeat_current_frame : false,
+tick : 0,
+)";
+	}
+
+	/// Layers drawn without clearing already accumulate, so they get no delta frames
+	bool use_delta_frames(const WriteOptions& options) const { return options.delta_frames && !no_clear; }
+
+	/// Culling assumes every frame starts with the identity transform, so no frame may change it at the top level
+	bool can_cull(const WriteOptions& options) const {
+		if (!options.cull_offscreen)
+			return false;
+		for (const auto& frm : frame_vec) {
+			for (const auto& dwbl : frm->drawables()) {
+				Transform2D t;
+				if (!dwbl->transform(t) || !t.is_identity())
+					return false;
+			}
+		}
+		return true;
+	}
+
+	/// Baking repeats the drawables of a frame for each tick it is held, the size grows by that much
+	bool use_baked_frames(const WriteOptions& options) const {
+		if (!options.bake_expressions)
+			return false;
+		size_t num_drawn = 0;
+		size_t num_baked = 0;
+		for (const auto& frm : frame_vec) {
+			size_t count = 0;
+			frm->visit([&count](const Drawable&) { ++count; });
+			num_drawn += count;
+			num_baked += frm->can_bake() ? count * (frm->hold_ticks() + 1) : count;
+		}
+		return num_baked > num_drawn && num_baked <= options.bake_size_factor * num_drawn;
+	}
+
+	/// Each key draws one tick of frm with literal values
+	static void write_baked_frame(OutputSink& os, const Frame& frm, const WriteOptions& options, bool cull) {
+		const auto hold = frm.hold_ticks();
+		ExpressionValue::Bindings values;
+		OutputSink key_out;
+		std::string last_key;
+		options.used_helpers->baked_frame = true;
+		os << "baked_frame([\n";
+		for (SizeType tick = 0; tick <= hold; ++tick) {
+			values.clear();
+			frm.evaluate_expressions(tick, values);
+			ExpressionValue::baked_values() = &values;
+			WriteContext context(options, cull);
+			const auto context_ptr = context.is_active() ? &context : nullptr;
+			FrameEncoder enc;
+			if (options.compact_frames && frm.encode_with(enc, context_ptr)) {
+				enc.write(key_out, *options.used_helpers);
+			}
+			else {
+				context = WriteContext(options, cull);
+				key_out << "(function(ctx, layer) {\n";
+				frm.draw_with(key_out, context_ptr);
+				key_out << "})";
+			}
+			ExpressionValue::baked_values() = nullptr;
+			// A key drawing the same as the previous one is written as null
+			if (tick > 0 && key_out.size() == last_key.size()
+				&& std::memcmp(key_out.data(), last_key.data(), last_key.size()) == 0) {
+				os << "null,\n";
+				key_out.clear();
+			}
+			else {
+				os.append(key_out);
+				os << ",\n";
+				last_key = key_out.take();
+			}
+		}
+		os << "])";
+	}
+
+	/// Frames held only by waits are marked with their tick count, the runtime draws them once.
+	/// Other held frames are marked too, so the runtime can skip ticks without running them
+	static void write_frame(OutputSink& os, const Frame& frm, const WriteOptions& options,
+		DeltaFrameState* delta = nullptr, bool cull = false, bool bake = false) {
+		if (bake && frm.can_bake()) {
+			if (delta)
+				*delta = DeltaFrameState();
+			write_baked_frame(os, frm, options, cull);
+			return;
+		}
+		const auto still = frm.still_ticks();
+		const auto hold = still > 0 ? 0 : frm.hold_ticks();
+		if (still > 0)
+			os << "still_frame(";
+		else if (hold > 0)
+			os << "held_frame(";
+		write_frame_content(os, frm, options, delta, cull);
+		if (still > 0)
+			os << ", " << still << ")";
+		else if (hold > 0)
+			os << ", " << hold << ")";
+	}
+
+	/// With delta set, frm is compared to the previous frame in delta, which then holds frm
+	static void write_frame_content(OutputSink& os, const Frame& frm, const WriteOptions& options,
+		DeltaFrameState* delta, bool cull) {
+		WriteContext context(options, cull);
+		const auto context_ptr = context.is_active() ? &context : nullptr;
+		if (delta) {
+			DeltaFrameState cur;
+			cur.assign(frm, context_ptr);
+			const auto first = delta->delta_start(cur);
+			std::swap(*delta, cur);
+			if (first > 0) {
+				write_delta_frame(os, frm, first, options, cull);
+				return;
+			}
+			// The delta text is drawn per drawable, so it has no batches across top-level lines
+			if (delta->drawn && !options.compact_frames && !options.batch_lines) {
+				os << "(function(ctx, layer) {\n" << delta->text << "})";
+				return;
+			}
+			context = WriteContext(options, cull);
+		}
+		if (options.compact_frames) {
+			FrameEncoder enc;
+			if (frm.encode_with(enc, context_ptr)) {
+				enc.write(os, *options.used_helpers);
+				return;
+			}
+			context = WriteContext(options, cull);
+		}
+		os << "(function(ctx, layer) {\n";
+		frm.draw_with(os, context_ptr);
+		os << "})";
+	}
+
+	/// Only the drawables from index first on are written, marked to be drawn over the previous frame
+	static void write_delta_frame(OutputSink& os, const Frame& frm, size_t first, const WriteOptions& options, bool cull) {
+		options.used_helpers->delta_frame = true;
+		os << "delta_frame(";
+		WriteContext context(options, cull);
+		const auto context_ptr = context.is_active() ? &context : nullptr;
+		if (options.compact_frames) {
+			FrameEncoder enc;
+			if (frm.encode_drawables(enc, first, context_ptr)) {
+				enc.write(os, *options.used_helpers);
+				os << ")";
+				return;
+			}
+			context = WriteContext(options, cull);
+		}
+		os << "(function(ctx, layer) {\n";
+		frm.draw_drawables(os, first, context_ptr);
+		os << "}))";
+	}
+
+	static constexpr size_t frames_per_chunk = 64;
+
+	/// Workers serialize chunks of frames into buffers that are passed to f in frame order.
+	/// Workers stay at most a few chunks per thread ahead of the writer to bound memory.
+	template<typename F>
+	void serialize_frames_parallel(const WriteOptions& options, F&& f) const {
+		const bool cull = can_cull(options);
+		const bool bake = use_baked_frames(options);
+		const auto num_chunks = (frame_vec.size() + frames_per_chunk - 1) / frames_per_chunk;
+		const auto max_ahead = options.num_threads * 4;
+		std::vector<std::vector<std::string>> chunks(num_chunks);
+		std::vector<bool> ready(num_chunks, false);
+		size_t next_chunk = 0;
+		size_t num_written = 0;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::exception_ptr error;
+
+		// The first exception stops handing out chunks and is rethrown once all threads are joined
+		auto fail = [&]() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+				next_chunk = num_chunks;
+			}
+			cond.notify_all();
+		};
+
+		auto worker = [&]() {
+			try {
+				while (true) {
+					size_t chunk_i;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						cond.wait(lock, [&] { return next_chunk == num_chunks || next_chunk < num_written + max_ahead; });
+						if (next_chunk == num_chunks)
+							return;
+						chunk_i = next_chunk++;
+					}
+					std::vector<std::string> texts;
+					OutputSink frame_out;
+					DeltaFrameState delta;
+					WriteContext context(options, cull);
+					const auto begin_i = chunk_i * frames_per_chunk;
+					if (begin_i > 0)
+						delta.assign(*frame_vec[begin_i - 1], context.is_active() ? &context : nullptr);
+					const auto end_i = std::min(frame_vec.size(), (chunk_i + 1) * frames_per_chunk);
+					for (auto frame_i = begin_i; frame_i < end_i; ++frame_i) {
+						write_frame(frame_out, *frame_vec[frame_i], options, use_delta_frames(options) ? &delta : nullptr, cull, bake);
+						texts.emplace_back(frame_out.str());
+						frame_out.clear();
+					}
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						chunks[chunk_i].swap(texts);
+						ready[chunk_i] = true;
+					}
+					cond.notify_all();
+				}
+			}
+			catch (...) {
+				fail();
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < options.num_threads; ++i) {
+			threads.emplace_back(worker);
+		}
+		try {
+			while (num_written < num_chunks) {
+				std::vector<std::string> texts;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cond.wait(lock, [&] { return ready[num_written] || error; });
+					if (error)
+						break;
+					texts.swap(chunks[num_written]);
+				}
+				for (auto& text : texts) {
+					f(text);
+				}
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					++num_written;
+				}
+				cond.notify_all();
+			}
+		}
+		catch (...) {
+			fail();
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	/// Calls f with the serialized text of each frame in frame order
+	template<typename F>
+	void serialize_frames(const WriteOptions& options, F&& f) const {
+		if (options.num_threads > 1 && frame_vec.size() > frames_per_chunk) {
+			serialize_frames_parallel(options, f);
+			return;
+		}
+		const bool cull = can_cull(options);
+		const bool bake = use_baked_frames(options);
+		OutputSink frame_out;
+		DeltaFrameState delta;
+		for (const auto& frm : frame_vec) {
+			write_frame(frame_out, *frm, options, use_delta_frames(options) ? &delta : nullptr, cull, bake);
+			std::string text = frame_out.str();
+			frame_out.clear();
+			f(text);
+		}
+	}
+
+	/// Each distinct frame text is written once, followed by the unique index of every frame
+	/// where a negative entry -n repeats the previous frame n more times
+	void write_frames_deduplicated(OutputSink& os, const WriteOptions& options) const {
+		std::vector<std::string> unique_texts;
+		std::unordered_map<size_t, std::vector<size_t>> indices_by_hash;
+		std::vector<long long> indices;
+		size_t num_repeats = 0;
+		options.used_helpers->expand_frames = true;
+		os << "frames: expand_frames([\n";
+		serialize_frames(options, [&](std::string& text) {
+			auto& candidates = indices_by_hash[std::hash<std::string>()(text)];
+			size_t index = unique_texts.size();
+			for (auto i : candidates) {
+				if (unique_texts[i] == text) {
+					index = i;
+					break;
+				}
+			}
+			if (index == unique_texts.size()) {
+				candidates.push_back(index);
+				os << text << ",\n";
+				unique_texts.emplace_back(std::move(text));
+			}
+			const auto previous = num_repeats > 0 ? indices[indices.size() - 2] : (indices.empty() ? -1 : indices.back());
+			if (previous == static_cast<long long>(index)) {
+				if (num_repeats++ == 0)
+					indices.push_back(-1);
+				else
+					--indices.back();
+			}
+			else {
+				num_repeats = 0;
+				indices.push_back(static_cast<long long>(index));
+			}
+		});
+		if (unique_texts.size() == frame_vec.size()) {
+			// Every frame is distinct, the unique frames are the frames
+			os << "], null),\n";
+			return;
+		}
+		os << "], [";
+		for (size_t i = 0; i < indices.size(); ++i) {
+			if (i > 0)
+				os << ",";
+			os << indices[i];
+		}
+		os << "]),\n";
+	}
+
+	DeltaFrameState* stream_delta() {
+		return use_delta_frames(*stream_options) ? &stream_delta_state : nullptr;
+	}
+
+	void flush_frame() {
+		const auto& frm = *frame_vec.front();
+		frm.define(*stream_ds);
+		if (!stream_accumulates && draws_into_surface(frm, *stream_options)) {
+			*stream_os << "layers[" << stream_index << "].accumulates = true;\n";
+			stream_accumulates = true;
+		}
+		*stream_os << "layers[" << stream_index << "].frames.push(";
+		if (stream_options->dedupe_frames) {
+			OutputSink frame_out;
+			write_frame(frame_out, frm, *stream_options, stream_delta());
+			if (num_streamed > 0 && frame_out.size() == last_streamed_text.size()
+				&& std::memcmp(frame_out.data(), last_streamed_text.data(), frame_out.size()) == 0) {
+				*stream_os << "layers[" << stream_index << "].frames[" << last_streamed_index << "]";
+			}
+			else {
+				stream_os->append(frame_out);
+				last_streamed_text = frame_out.take();
+				last_streamed_index = num_streamed;
+			}
+		}
+		else {
+			write_frame(*stream_os, frm, *stream_options, stream_delta());
+		}
+		*stream_os << ");\n";
+		frame_vec.erase(frame_vec.begin());
+		++num_streamed;
+	}
+
+	void add_frame() {
+		frame_vec.emplace_back(std::make_unique<Frame>(&arena));
+		frame_vec.back()->set_fps(fps);
+	}
 
 public:
-	Layer() { clear(); }
+	explicit Layer(SizeType fps = FPS) : fps{ fps } { clear(); }
+
+	/// True if frm or a macro it calls draws into a surface
+	static bool draws_into_surface(const Frame& frm, const WriteOptions& options) {
+		bool found = false;
+		frm.visit([&found, &options](const Drawable& dwbl) {
+			if (dynamic_cast<const Surface*>(&dwbl))
+				found = true;
+			else if (auto call = dynamic_cast<const DrawMacro*>(&dwbl))
+				found = found || options.surface_macros.count(call->get_name()) > 0;
+			else if (auto call = dynamic_cast<const DrawMacroInstances*>(&dwbl))
+				found = found || options.surface_macros.count(call->get_name()) > 0;
+		});
+		return found;
+	}
 
 	void clear() {
 		frame_vec.clear();
+		arena.release();
 		cur_frame = 0;
-		frame_vec.emplace_back(std::make_unique<Frame>());
+		add_frame();
+	}
+
+	/// Applies to the frames not yet written
+	void set_fps(SizeType frames_per_sec) {
+		fps = frames_per_sec;
+		for (auto& frm : frame_vec)
+			frm->set_fps(fps);
 	}
 
 	auto& frame() { return *frame_vec[cur_frame]; }
-	auto get_num_frames() const { return frame_vec.size(); }
-	void rewind() { cur_frame = 0; }
-	auto get_frame_index() const { return cur_frame; }
+	auto get_num_frames() const { return num_streamed + frame_vec.size(); }
+	void rewind() {
+		if (stream_os)
+			throw std::logic_error("Cannot rewind a streaming layer");
+		cur_frame = 0;
+	}
+	auto get_frame_index() const { return num_streamed + cur_frame; }
 	void set_no_clear(bool do_clear) { no_clear = do_clear; }
+	/// A static layer is drawn once and then only composited, so only its first frame is ever shown
+	void set_static(bool do_static) { is_static = do_static; }
 
 	void next_frame() {
 		if (cur_frame == frame_vec.size() - 1) {
-			frame_vec.emplace_back(std::make_unique<Frame>());
+			add_frame();
 		}
 		++cur_frame;
+		if (stream_os) {
+			flush_frame();
+			--cur_frame;
+			// Only the new, empty frame is left
+			arena.release();
+		}
 	}
 
 	void remove_last_frame() {
@@ -778,22 +2922,114 @@ public:
 			frame_vec.pop_back();
 	}
 
-	void write_frames(std::ostream& os) const {
-		os << R"({frame_counter: 0,
-no_clear : false,
-repeat_current_frame : false,
-expressions : {},
-)";
-		os << "frames: [\n";
-		for (size_t frame_i = 0; frame_i < frame_vec.size(); ++frame_i) {
-			os << "(function(ctx, layer) {\n";
-			frame_vec[frame_i]->draw(os);
-			os << "}),\n";
+	/// Write all finished frames to os and from then on write each frame as soon as next_frame() leaves it
+	void start_streaming(OutputSink& os, DefinitionsStream& ds, const WriteOptions& options, size_t index) {
+		if (cur_frame + 1 != frame_vec.size())
+			throw std::logic_error("Streaming requires the current frame to be the last frame");
+		stream_os = &os;
+		stream_ds = &ds;
+		stream_options = &options;
+		stream_index = index;
+		os << "layers.push(";
+		write_properties(os, options);
+		stream_accumulates = accumulates(options);
+		os << "frames: [],\n});\n";
+		while (cur_frame > 0) {
+			flush_frame();
+			--cur_frame;
+		}
+	}
+
+	/// Write the remaining frames and leave streaming mode
+	void finish_streaming() {
+		while (!frame_vec.empty()) {
+			flush_frame();
+		}
+		cur_frame = 0;
+		stream_os = nullptr;
+		stream_ds = nullptr;
+		stream_options = nullptr;
+		last_streamed_text.clear();
+		stream_delta_state = DeltaFrameState();
+	}
+
+	void write_frames(OutputSink& os, const WriteOptions& options) const {
+		write_properties(os, options);
+		if (options.dedupe_frames) {
+			write_frames_deduplicated(os, options);
+		}
+		else if (options.num_threads > 1 && frame_vec.size() > frames_per_chunk) {
+			os << "frames: [\n";
+			serialize_frames_parallel(options, [&os](const std::string& text) { os << text << ",\n"; });
+			os << "],\n";
+		}
+		else {
+			os << "frames: [\n";
+			const bool cull = can_cull(options);
+			const bool bake = use_baked_frames(options);
+			DeltaFrameState delta;
+			for (const auto& frm : frame_vec) {
+				write_frame(os, *frm, options, use_delta_frames(options) ? &delta : nullptr, cull, bake);
+				os << ",\n";
+			}
+			os << "],\n";
 		}
-		os << "],\n";
 		os << "},\n";
 	}
 
+	/// JS helper rebuilding a frames array from the unique frames and their indices
+	static void define_expand_frames(DefinitionsStream& ds) {
+		ds.write_if_undefined(typeid(Layer).hash_code(), R"(
+function expand_frames(unique_frames, indices) {
+	if(indices === null)
+		return unique_frames;
+	const frames = [];
+	for(const i of indices) {
+		if(i >= 0)
+			frames.push(unique_frames[i]);
+		else
+			for(let n = 0; n < -i; ++n)
+				frames.push(frames[frames.length - 1]);
+	}
+	return frames;
+}
+)");
+	}
+
+	/// JS helper drawing the key of the current tick, a null key repeats the previous one
+	static void define_baked_frame(DefinitionsStream& ds) {
+		ds.write_if_undefined(typeid(Expression).hash_code(), R"(
+function baked_frame(keys) {
+	for(let i = 1; i < keys.length; ++i)
+		if(keys[i] === null)
+			keys[i] = keys[i - 1];
+	const f = function(ctx, layer) {
+		keys[layer.tick](ctx, layer);
+		layer.repeat_current_frame = layer.tick < keys.length - 1;
+	};
+	f.hold = keys.length - 1;
+	return f;
+}
+)");
+	}
+
+	/// JS helper marking frames that draw over the previous frame instead of clearing
+	static void define_delta_frame(DefinitionsStream& ds) {
+		ds.write_if_undefined(typeid(DeltaFrameState).hash_code(), R"(
+function delta_frame(f) {
+	f.delta = true;
+	return f;
+}
+)");
+	}
+
+	template<typename F>
+	void visit_drawables(F&& f) const {
+		for (const auto& frm : frame_vec) {
+			frm->visit(f);
+		}
+	}
+
 	void write_definitions(DefinitionsStream& ds) const {
 		for (const auto& frm : frame_vec) {
 			frm->define(ds);
@@ -819,8 +3055,15 @@ private:
 	LayerVector layer_vec;
 	size_t cur_layer{ 0 };
 	size_t num_surfaces{ 0 };
+	SizeType fps{ FPS };
 
 	std::string output_file;
+	WriteOptions write_options;
+
+	std::FILE* stream_fp{ nullptr };
+	std::unique_ptr<OutputSink> stream_os;
+	OutputSink stream_definitions;
+	std::unique_ptr<DefinitionsStream> stream_ds;
 
 public:
 	HtmlAnim() { clear(); }
@@ -833,17 +3076,50 @@ public:
 
 	~HtmlAnim()
 	{
-		if(!output_file.empty()) {
+		if(stream_os) {
+			close_stream();
+		}
+		else if(!output_file.empty()) {
 			write_file(output_file.c_str());
 		}
 	}
 
 	void set_num_surfaces(size_t n) { num_surfaces = n; }
+	/// Write frames without expressions as compact opcode streams instead of JS functions
+	void set_compact_frames(bool compact) { write_options.compact_frames = compact; }
+	/// Serialize frames on n threads when writing the whole animation, streaming always uses one
+	void set_num_writer_threads(size_t n) { write_options.num_threads = (n > 0) ? n : 1; }
+	/// Share the code of byte-identical frames instead of writing each one
+	void set_dedupe_frames(bool dedupe) { write_options.dedupe_frames = dedupe; }
+	/// Leave out drawables that lie outside the canvas, streamed frames are never culled
+	void set_cull_offscreen(bool cull) { write_options.cull_offscreen = cull; }
+	/// Stroke runs of consecutive unfilled lines as one path, overlaps within a run are painted once
+	void set_batch_lines(bool batch) { write_options.batch_lines = batch; }
+	/// Write frames extending the previous frame as only the added drawables, drawn without clearing
+	void set_delta_frames(bool delta) { write_options.delta_frames = delta; }
+	/// Compute animated values in C++ and write their frames as keyframes, in each layer where that grows
+	/// the written drawables at most by max_size_factor. Streamed frames are never baked
+	void set_bake_expressions(bool bake, CoordType max_size_factor = 8) {
+		write_options.bake_expressions = bake;
+		write_options.bake_size_factor = max_size_factor;
+	}
+	/// Ticks per second of playback, independent of the display refresh rate. Set it before adding frames
+	/// so that tweens and eases given in seconds are converted with it, waits count ticks
+	void set_fps(SizeType frames_per_sec) {
+		if (frames_per_sec == 0)
+			throw std::logic_error("FPS must be positive");
+		fps = frames_per_sec;
+		for (auto& lyr : layer_vec)
+			lyr->set_fps(fps);
+	}
+	auto get_fps() const { return fps; }
 
 	void clear() {
+		if (stream_os)
+			throw std::logic_error("Cannot clear a streaming animation");
 		layer_vec.clear();
 		cur_layer = 0;
-		layer_vec.emplace_back(std::make_unique<Layer>());
+		layer_vec.emplace_back(std::make_unique<Layer>(fps));
 	}
 
 	auto& css_style() {return css_style_stream;}
@@ -854,7 +3130,9 @@ public:
 
 	void add_layer() {
 		if (cur_layer == layer_vec.size() - 1) {
-			layer_vec.emplace_back(std::make_unique<Layer>());
+			layer_vec.emplace_back(std::make_unique<Layer>(fps));
+			if (stream_os)
+				layer_vec.back()->start_streaming(*stream_os, *stream_ds, write_options, layer_vec.size() - 1);
 		}
 		++cur_layer;
 	}
@@ -863,6 +3141,7 @@ public:
 	void next_frame() { layer().next_frame(); }
 
 	void write_stream(std::ostream&) const;
+	void write_stream(OutputSink&) const;
 	void write_file(const char*) const;
 
 	auto get_width() const {return width;}
@@ -870,23 +3149,48 @@ public:
 
 	void write_file_on_destruct(const std::string& file) { output_file = file; }
 
+	/// Write frames to the file as they are finished instead of keeping them until write_file()
+	void stream_file(const char*);
+	/// Write frames to os as they are finished. CSS, pre text and surfaces must be set up before this call
+	void stream(std::ostream&);
+	/// Write all unfinished frames and the end of the document. Called by the destructor if still streaming
+	void close_stream();
+	bool is_streaming() const { return stream_os != nullptr; }
+
 private:
-	void write_header(std::ostream& os) const;
-	void write_canvas(std::ostream& os) const;
-	void write_script(std::ostream& os) const;
-	void write_definitions(std::ostream& os) const;
-	void write_layers(std::ostream& os) const;
-	void write_footer(std::ostream& os) const;
+	void start_stream();
+	void write_header(OutputSink& os) const;
+	void write_canvas(OutputSink& os) const;
+	void write_script(OutputSink& os) const;
+	void write_script_begin(OutputSink& os) const;
+	void write_script_end(OutputSink& os) const;
+	/// Only the helpers some written frame calls are defined
+	static void define_helpers(DefinitionsStream& ds, const UsedHelpers& used);
+	void write_definitions(OutputSink& os, const UsedHelpers& used) const;
+	/// Returns the helpers the written frames call
+	std::shared_ptr<const UsedHelpers> write_layers(OutputSink& os) const;
+	void write_footer(OutputSink& os) const;
 };
 
 void HtmlAnim::write_file(const char* path) const {
-	std::ofstream outfile;
-	outfile.open(path);
-	write_stream(outfile);
-	outfile.close();
+	auto fp = std::fopen(path, "w");
+	if (!fp)
+		return;
+	{
+		OutputSink out(fp);
+		write_stream(out);
+	}
+	std::fclose(fp);
 }
 
 void HtmlAnim::write_stream(std::ostream& os) const {
+	OutputSink out(os);
+	write_stream(out);
+}
+
+void HtmlAnim::write_stream(OutputSink& os) const {
+	if (stream_os)
+		throw std::logic_error("Cannot write a streaming animation");
 	write_header(os);
 	os << pre_text_stream.str() << "\n";
 	write_canvas(os);
@@ -895,7 +3199,60 @@ void HtmlAnim::write_stream(std::ostream& os) const {
 	write_footer(os);
 }
 
-void HtmlAnim::write_header(std::ostream& os) const {
+void HtmlAnim::stream_file(const char* path) {
+	if (stream_os)
+		throw std::logic_error("Animation is already streaming");
+	stream_fp = std::fopen(path, "w");
+	if (!stream_fp)
+		throw std::runtime_error("Cannot open streaming output file");
+	stream_os = std::make_unique<OutputSink>(stream_fp);
+	start_stream();
+}
+
+void HtmlAnim::stream(std::ostream& os) {
+	if (stream_os)
+		throw std::logic_error("Animation is already streaming");
+	stream_os = std::make_unique<OutputSink>(os);
+	start_stream();
+}
+
+void HtmlAnim::start_stream() {
+	auto& os = *stream_os;
+	write_header(os);
+	os << pre_text_stream.str() << "\n";
+	write_canvas(os);
+	write_script_begin(os);
+	os << "layers = [];\n";
+	stream_ds = std::make_unique<DefinitionsStream>(stream_definitions);
+	write_options.used_helpers = std::make_shared<UsedHelpers>();
+	for (size_t layer_i = 0; layer_i < layer_vec.size(); ++layer_i) {
+		layer_vec[layer_i]->start_streaming(os, *stream_ds, write_options, layer_i);
+	}
+}
+
+void HtmlAnim::close_stream() {
+	if (!stream_os)
+		return;
+	auto& os = *stream_os;
+	for (auto& lyr : layer_vec) {
+		lyr->finish_streaming();
+	}
+	// Definitions are function declarations, so they may follow the frames that use them
+	define_helpers(*stream_ds, *write_options.used_helpers);
+	os.append(stream_definitions);
+	write_script_end(os);
+	os << post_text_stream.str() << "\n";
+	write_footer(os);
+	stream_os.reset();
+	stream_ds.reset();
+	stream_definitions.clear();
+	if (stream_fp) {
+		std::fclose(stream_fp);
+		stream_fp = nullptr;
+	}
+}
+
+void HtmlAnim::write_header(OutputSink& os) const {
 	os << R"(<!doctype html>
 <html>
 <head>
@@ -906,18 +3263,27 @@ void HtmlAnim::write_header(std::ostream& os) const {
 	os << "<title>" << title << "</title>\n";
 
 	os << "</head>\n";
-	os << "<style type='text/css'>" << css_style_stream.str() << "</style>\n";
+	os << "<style type='text/css'>";
+	os << css_style_stream.str() << "</style>\n";
 	os << "<body>\n";
 }
 
-void HtmlAnim::write_canvas(std::ostream& os) const {
+void HtmlAnim::write_canvas(OutputSink& os) const {
 	os << "<canvas id='" << canvas_name 
 		<< "' width='" << width
 		<< "' height='" << height
 		<< "'></canvas>\n";
 }
 
-void HtmlAnim::write_script(std::ostream& os) const {
+void HtmlAnim::write_script(OutputSink& os) const {
+	write_script_begin(os);
+	// Definitions are function declarations, so they may follow the frames that use them
+	const auto used_helpers = write_layers(os);
+	write_definitions(os, *used_helpers);
+	write_script_end(os);
+}
+
+void HtmlAnim::write_script_begin(OutputSink& os) const {
 	os << "<script>\n";
 	os << "<!--\n";
 	os << "var canvas = document.getElementById('" << canvas_name << "');\n";
@@ -933,12 +3299,12 @@ cv.height = canvas.height;
 surfaces.push(cv);
 }
 )";
+}
 
-	write_definitions(os);
-	write_layers(os);
-
+void HtmlAnim::write_script_end(OutputSink& os) const {
 	os << R"(
 const num_layers = layers.length;
+const tick_ms = 1000 / )" << fps << R"(;
 
 for(var i = 0; i < num_layers; i++) {
 	var cv = document.createElement('canvas');
@@ -947,27 +3313,126 @@ for(var i = 0; i < num_layers; i++) {
 	offscreens.push(cv);
 }
 
-function draw_layer(ctx, layer) {
-		if(layer.frame_counter == 0 || !layer.no_clear)
+function still_frame(f, ticks) {
+	f.still = ticks;
+	return f;
+}
+
+function held_frame(f, ticks) {
+	f.hold = ticks;
+	return f;
+}
+
+// Ticks a frame is shown for, frames held by unknown expressions count as one
+function frame_ticks(frame) {
+		if(frame.still !== undefined)
+			return frame.still + 1;
+		if(frame.hold !== undefined)
+			return frame.hold + 1;
+		return 1;
+}
+
+function next_layer_frame(layer) {
+		layer.frame_counter = (layer.frame_counter + 1) % layer.frames.length;
+		layer.tick = 0;
+}
+
+// Moves the layer on by ticks without drawing
+function skip_layer_ticks(layer, ticks) {
+		while(ticks > 0) {
+			const left = Math.max(1, frame_ticks(layer.frames[layer.frame_counter]) - layer.tick);
+			if(ticks < left) {
+				layer.tick += ticks;
+				return;
+			}
+			ticks -= left;
+			next_layer_frame(layer);
+		}
+}
+
+function paint_frame(ctx, layer, frame_i) {
+		const frame = layer.frames[frame_i];
+		if(frame_i == 0 || !(layer.no_clear || frame.delta))
 			ctx.clearRect(0, 0, canvas.width, canvas.height);
 		layer.repeat_current_frame = false;
-		(layer.frames[layer.frame_counter])(ctx, layer);
-		if(!layer.repeat_current_frame) {
-			layer.frame_counter = (layer.frame_counter + 1) % layer.frames.length;
-			layer.expressions = {};
+		frame(ctx, layer);
+		layer.drawn_frame = frame_i;
+}
+
+// A delta frame draws over the previous frame, which skipped ticks may have left undrawn.
+// The frames back to the last drawn one or the start of the deltas are drawn at their last tick
+function paint_delta_base(ctx, layer) {
+		var first = layer.frame_counter;
+		while(first > 0 && layer.frames[first].delta && layer.drawn_frame !== first - 1)
+			--first;
+		if(first == layer.frame_counter)
+			return;
+		const tick = layer.tick;
+		for(var i = first; i < layer.frame_counter; ++i) {
+			layer.tick = frame_ticks(layer.frames[i]) - 1;
+			paint_frame(ctx, layer, i);
+		}
+		layer.tick = tick;
+}
+
+function draw_layer(ctx, layer) {
+		layer.dirty = false;
+		if(layer.static_layer && layer.drawn)
+			return;
+		layer.drawn = true;
+		const frame = layer.frames[layer.frame_counter];
+		// Still frames are drawn once, unless their first tick was skipped
+		if(frame.still === undefined || layer.drawn_frame !== layer.frame_counter || layer.tick == 0) {
+			if(frame.delta)
+				paint_delta_base(ctx, layer);
+			paint_frame(ctx, layer, layer.frame_counter);
+			layer.dirty = true;
 		}
+		if(frame.still !== undefined ? layer.tick < frame.still : layer.repeat_current_frame)
+			++layer.tick;
+		else
+			next_layer_frame(layer);
 }
 
 window.onload = function() {
-	(function draw_canvas () {
-		for (var i = 0; i < num_layers; i++) {
-			var ctx = offscreens[i].getContext('2d');
-			var layer = layers[i];
-			draw_layer(ctx, layer);
+	var start_time;
+	var num_ticks = 0;
+	(function draw_canvas (time) {
+		if(time === undefined)
+			time = performance.now();
+		if(start_time === undefined)
+			start_time = time;
+		// Ticks follow the elapsed time, not the display refresh rate.
+		// Ticks missed since the last call are skipped and each layer is drawn once at the current tick,
+		// except in layers that accumulate, which draw every missed tick
+		const due_ticks = Math.floor((time - start_time) / tick_ms + 0.5) + 1;
+		var dirty = false;
+		if(due_ticks > num_ticks) {
+			const missed_ticks = due_ticks - num_ticks - 1;
+			for(var t = 0; t < missed_ticks; ++t) {
+				for (var i = 0; i < num_layers; i++) {
+					var layer = layers[i];
+					if(layer.accumulates) {
+						draw_layer(offscreens[i].getContext('2d'), layer);
+						dirty = dirty || layer.dirty;
+					}
+				}
+			}
+			for (var i = 0; i < num_layers; i++) {
+				var ctx = offscreens[i].getContext('2d');
+				var layer = layers[i];
+				if(!layer.accumulates)
+					skip_layer_ticks(layer, missed_ticks);
+				draw_layer(ctx, layer);
+				dirty = dirty || layer.dirty;
+			}
+			num_ticks = due_ticks;
 		}
-		var ctx = canvas.getContext('2d');
-		for (var i = 0; i < num_layers; i++) {
-			ctx.drawImage(offscreens[i], 0, 0);
+		if(dirty) {
+			var ctx = canvas.getContext('2d');
+			for (var i = 0; i < num_layers; i++) {
+				ctx.drawImage(offscreens[i], 0, 0);
+			}
 		}
 		window.requestAnimationFrame(draw_canvas, canvas);
 	}());
@@ -979,22 +3444,64 @@ window.onload = function() {
 )";
 }
 
-void HtmlAnim::write_definitions(std::ostream& os) const {
+void HtmlAnim::define_helpers(DefinitionsStream& ds, const UsedHelpers& used) {
+	if (used.packed_frame)
+		FrameEncoder::define(ds);
+	if (used.expand_frames)
+		Layer::define_expand_frames(ds);
+	if (used.delta_frame)
+		Layer::define_delta_frame(ds);
+	if (used.stroke_paths)
+		Frame::define_stroke_paths(ds);
+	if (used.baked_frame)
+		Layer::define_baked_frame(ds);
+}
+
+void HtmlAnim::write_definitions(OutputSink& os, const UsedHelpers& used) const {
 	DefinitionsStream ds(os);
+	define_helpers(ds, used);
 	for(const auto& lyr : layer_vec) {
 		lyr->write_definitions(ds);
 	}
 }
 
-void HtmlAnim::write_layers(std::ostream& os) const {
+std::shared_ptr<const UsedHelpers> HtmlAnim::write_layers(OutputSink& os) const {
+	auto options = write_options;
+	options.used_helpers = std::make_shared<UsedHelpers>();
+	if (options.cull_offscreen) {
+		// The context keeps its line width across frames and macros may run in any layer,
+		// so the margin covers the widest line anywhere. Miter joins reach up to 10 half widths.
+		CoordType max_line_width = 1;
+		for (const auto& lyr : layer_vec) {
+			lyr->visit_drawables([&](const Drawable& dwbl) {
+				if (auto lw = dynamic_cast<const LineWidth*>(&dwbl)) {
+					if (!lw->get_width().is_literal())
+						options.cull_offscreen = false;
+					else
+						max_line_width = std::max(max_line_width, std::abs(lw->get_width().get_number()));
+				}
+			});
+		}
+		options.viewport = BoundingBox(0, 0, width, height);
+		options.cull_margin = max_line_width * 5 + 1;
+	}
+	// Macros are defined in one layer and may be called from any
+	for (const auto& lyr : layer_vec) {
+		lyr->visit_drawables([&](const Drawable& dwbl) {
+			auto macro = dynamic_cast<const DefineMacro*>(&dwbl);
+			if (macro && Layer::draws_into_surface(*macro, options))
+				options.surface_macros.insert(macro->get_name());
+		});
+	}
 	os << "layers = [\n";
 	for (const auto& lyr : layer_vec) {
-		lyr->write_frames(os);
+		lyr->write_frames(os, options);
 	}
 	os << "];\n";
+	return options.used_helpers;
 }
 
-void HtmlAnim::write_footer(std::ostream& os) const {
+void HtmlAnim::write_footer(OutputSink& os) const {
 	os << R"(
 </body>
 </html>
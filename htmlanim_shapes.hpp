@@ -64,9 +64,15 @@ function regular_polygon(ctx, x, y, r, edges, fill) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "regular_polygon(ctx, " << x.to_string() << ", " << y.to_string()
-			<< ", " << r.to_string() << ", " << edges.to_string() << ", " << fill.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "regular_polygon(ctx, " << x << ", " << y
+			<< ", " << r << ", " << edges << ", " << fill << ");\n";
+	}
+	virtual BoundingBox bounds() const override {
+		if (!x.is_literal() || !y.is_literal() || !r.is_literal())
+			return BoundingBox();
+		const auto r_abs = std::abs(r.get_number());
+		return BoundingBox(x.get_number() - r_abs, y.get_number() - r_abs, x.get_number() + r_abs, y.get_number() + r_abs);
 	}
 };
 
@@ -107,9 +113,16 @@ ctx.restore();
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "smiley(ctx, " << x.to_string() << ", " << y.to_string()
-			<< ", " << r.to_string() << ");\n";
+	virtual void draw(OutputSink& os) const override {
+		os << "smiley(ctx, " << x << ", " << y
+			<< ", " << r << ");\n";
+	}
+	/// Includes the outline, which is stroked 0.05 * r wide
+	virtual BoundingBox bounds() const override {
+		if (!x.is_literal() || !y.is_literal() || !r.is_literal())
+			return BoundingBox();
+		const auto r_abs = 1.025 * std::abs(r.get_number());
+		return BoundingBox(x.get_number() - r_abs, y.get_number() - r_abs, x.get_number() + r_abs, y.get_number() + r_abs);
 	}
 };
 
@@ -147,12 +160,20 @@ function grid(ctx, x, y, dx, dy, nx, ny) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "grid(ctx, " << x.to_string() << ", " << y.to_string()
-			<< ", " << dx.to_string() << ", " << dy.to_string()
-			<< ", " << nx.to_string() << ", " << ny.to_string()
+	virtual void draw(OutputSink& os) const override {
+		os << "grid(ctx, " << x << ", " << y
+			<< ", " << dx << ", " << dy
+			<< ", " << nx << ", " << ny
 			<< ");\n";
 	}
+	virtual BoundingBox bounds() const override {
+		if (!x.is_literal() || !y.is_literal() || !dx.is_literal() || !dy.is_literal()
+			|| !nx.is_literal() || !ny.is_literal())
+			return BoundingBox();
+		return BoundingBox(x.get_number(), y.get_number(),
+			x.get_number() + std::trunc(nx.get_number()) * dx.get_number(),
+			y.get_number() + std::trunc(ny.get_number()) * dy.get_number());
+	}
 };
 
 class SubdividedGrid : public Grid {
@@ -180,11 +201,11 @@ function subdivided_grid(ctx, x, y, dx, dy, nx, ny, sx, sy, bgstyle, fgstyle) {
 }
 )");
 	}
-	virtual void draw(std::ostream& os) const override {
-		os << "subdivided_grid(ctx, " << x.to_string() << ", " << y.to_string()
-			<< ", " << dx.to_string() << ", " << dy.to_string()
-			<< ", " << nx.to_string() << ", " << ny.to_string()
-			<< ", " << sx.to_string() << ", " << sy.to_string()
+	virtual void draw(OutputSink& os) const override {
+		os << "subdivided_grid(ctx, " << x << ", " << y
+			<< ", " << dx << ", " << dy
+			<< ", " << nx << ", " << ny
+			<< ", " << sx << ", " << sy
 			<< ", \"" << bgstyle << "\", \"" << fgstyle << "\""
 			<< ");\n";
 	}